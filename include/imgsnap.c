@@ -0,0 +1,584 @@
+/**
+ *  @file        imgsnap.c
+ *  @details     Non-blocking crash image snapshots for libpmfuzz, see
+ *               imgsnap.h for the modes and the delta image format.
+ */
+
+#define _GNU_SOURCE
+
+#include "imgsnap.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Soft-dirty bit of a /proc/self/pagemap entry, see pagemap.rst */
+#define PAGEMAP_SOFT_DIRTY  (1ULL << 55)
+/* Number of pagemap entries read per pread() */
+#define PAGEMAP_BATCH       (512)
+/* Number of page records written per writev() */
+#define DELTA_BATCH         (64)
+
+/* Children currently writing an image */
+static pid_t    snap_children[IMGSNAP_MAX_CHILDREN];
+static int      snap_child_cnt  = 0;
+static int      snap_exit_hook  = 0;
+static int      snap_mode       = -1;
+
+/* Pool and image the next delta is computed against */
+static void    *delta_addr      = NULL;
+static size_t   delta_size      = 0;
+static char     delta_parent[PATH_MAX];
+static int      soft_dirty_ok   = -1;
+
+/**
+ * @brief Reads the FI_SNAPSHOT environment and converts it to ImgSnapMode
+ * The value is read once and cached for the lifetime of the process.
+ * @return Snapshot mode corresponding to the env var
+ */
+ImgSnapMode_t imgsnap_get_mode(void) {
+    if (snap_mode >= 0)
+        return (ImgSnapMode_t)snap_mode;
+
+    char *mode_str = getenv(IMGSNAP_ENV);
+    if (mode_str == NULL || strcmp(mode_str, "") == 0
+            || strcmp(mode_str, "SYNC") == 0) {
+        snap_mode = ISM_SYNC;
+    } else if (strcmp(mode_str, "FORK") == 0) {
+        snap_mode = ISM_FORK;
+    } else if (strcmp(mode_str, "DELTA") == 0) {
+        snap_mode = ISM_DELTA;
+    } else {
+        dprintf(2, "Invalid snapshot mode (%s), check documentation\n",
+            mode_str);
+        exit(1);
+    }
+    return (ImgSnapMode_t)snap_mode;
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *ptr = buf;
+    while (len > 0) {
+        ssize_t ret = write(fd, ptr, len);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        ptr += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len) {
+    char *ptr = buf;
+    while (len > 0) {
+        ssize_t ret = read(fd, ptr, len);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        } else if (ret == 0) {
+            errno = EIO;
+            return -1;
+        }
+        ptr += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+/* Images are written to a temporary name first so that a reader never sees
+   a partially written image */
+static void tmp_name(char *buf, size_t len, const char *path) {
+    snprintf(buf, len, "%s.tmp", path);
+}
+
+static int publish(int fd, const char *tmp, const char *path, int failed) {
+    if (close(fd) != 0)
+        failed = 1;
+    if (failed) {
+        unlink(tmp);
+        return -1;
+    }
+    return rename(tmp, path);
+}
+
+/**
+ * @brief Waits for the snapshot children until less than `keep` are running
+ * @param keep Number of children allowed to keep running, 0 waits for all
+ * @param block If 0, only reaps children that have already exited
+ */
+static void reap_children(int keep, int block) {
+    int i = 0;
+    while (i < snap_child_cnt) {
+        int status;
+        int must_wait = block && snap_child_cnt > keep;
+        pid_t ret = waitpid(snap_children[i], &status, must_wait ? 0 : WNOHANG);
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+
+        if (ret == 0) {
+            i++;
+            continue;
+        }
+
+        if (ret > 0 && (!WIFEXITED(status) || WEXITSTATUS(status) != 0)) {
+            dprintf(2, "[FI] Snapshot process %d failed to write image\n",
+                snap_children[i]);
+        }
+
+        /* Exited (or no longer our child): drop it */
+        snap_children[i] = snap_children[--snap_child_cnt];
+    }
+}
+
+/**
+ * @brief Waits for all the pending snapshots to be written
+ * Registered with atexit() on the first snapshot so the images are complete
+ * by the time the target exits.
+ */
+void imgsnap_wait_all(void) {
+    reap_children(0, 1);
+}
+
+/**
+ * @brief Forks a child that runs `writer` on its copy-on-write view of the
+ * process and exits.  Falls back to running the writer in place if fork
+ * fails.
+ */
+static int spawn_writer(int (*writer)(const void*), const void *arg) {
+    if (!snap_exit_hook) {
+        atexit(imgsnap_wait_all);
+        snap_exit_hook = 1;
+    }
+
+    /* Bound the number of children writing at any time */
+    reap_children(IMGSNAP_MAX_CHILDREN - 1, 1);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        _exit(writer(arg) == 0 ? 0 : 1);
+    } else if (pid < 0) {
+        perror("[FI] fork() for snapshot failed, writing image in place");
+        return writer(arg);
+    }
+
+    snap_children[snap_child_cnt++] = pid;
+    return 0;
+}
+
+/**
+ * @brief Copies a file, sharing extents with the source (reflink) when the
+ * file system supports it
+ */
+int imgsnap_copy_file(const char *src_path, const char *dst_path) {
+    char tmp[PATH_MAX];
+    struct stat st;
+    int failed = 0;
+
+    int src = open(src_path, O_RDONLY);
+    if (src < 0)
+        return -1;
+    if (fstat(src, &st) != 0) {
+        close(src);
+        return -1;
+    }
+
+    tmp_name(tmp, sizeof(tmp), dst_path);
+    int dst = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (dst < 0) {
+        close(src);
+        return -1;
+    }
+
+    if (ioctl(dst, FICLONE, src) != 0) {
+        off_t remaining = st.st_size;
+        while (remaining > 0) {
+            ssize_t ret = copy_file_range(src, NULL, dst, NULL, remaining, 0);
+            if (ret < 0 && errno == EINTR)
+                continue;
+            if (ret <= 0)
+                break;
+            remaining -= ret;
+        }
+
+        /* copy_file_range() is not supported everywhere, finish by hand */
+        if (remaining > 0) {
+            char buf[1 << 16];
+            off_t off = st.st_size - remaining;
+            while (remaining > 0) {
+                ssize_t ret = pread(src, buf, sizeof(buf), off);
+                if (ret < 0 && errno == EINTR)
+                    continue;
+                if (ret <= 0 || pwrite(dst, buf, ret, off) != ret) {
+                    failed = 1;
+                    break;
+                }
+                off += ret;
+                remaining -= ret;
+            }
+        }
+    }
+
+    close(src);
+    return publish(dst, tmp, dst_path, failed);
+}
+
+/* Arguments for the writers run in the snapshot children */
+typedef struct {
+    const char *dst_path;
+    const char *parent;
+    const char *addr;
+    size_t      size;
+    uint64_t   *pages;
+    uint64_t    page_cnt;
+    uint32_t    page_size;
+} snap_job_t;
+
+static int write_full_image(const void *arg) {
+    const snap_job_t *job = arg;
+    char tmp[PATH_MAX];
+
+    tmp_name(tmp, sizeof(tmp), job->dst_path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+
+    int failed = write_all(fd, job->addr, job->size);
+    return publish(fd, tmp, job->dst_path, failed);
+}
+
+static int write_delta_image(const void *arg) {
+    const snap_job_t *job = arg;
+    char tmp[PATH_MAX];
+    imgsnap_delta_hdr_t hdr;
+
+    memcpy(hdr.magic, IMGSNAP_DELTA_MAGIC, sizeof(hdr.magic));
+    hdr.img_size    = job->size;
+    hdr.page_size   = job->page_size;
+    hdr.parent_len  = strlen(job->parent);
+    hdr.page_cnt    = job->page_cnt;
+
+    tmp_name(tmp, sizeof(tmp), job->dst_path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+
+    int failed = write_all(fd, &hdr, sizeof(hdr))
+        || write_all(fd, job->parent, hdr.parent_len);
+
+    /* { index, page } records, DELTA_BATCH pages per syscall */
+    struct iovec iov[2*DELTA_BATCH];
+    uint64_t i = 0;
+    while (!failed && i < job->page_cnt) {
+        int iovcnt = 0;
+        size_t len = 0;
+        for (; i < job->page_cnt && iovcnt < 2*DELTA_BATCH; i++) {
+            size_t off = job->pages[i]*job->page_size;
+
+            /* The last page is clamped to the end of the pool */
+            size_t page_len = job->size - off;
+            if (page_len > job->page_size)
+                page_len = job->page_size;
+
+            iov[iovcnt].iov_base    = &job->pages[i];
+            iov[iovcnt++].iov_len   = sizeof(uint64_t);
+            iov[iovcnt].iov_base    = (void*)(job->addr + off);
+            iov[iovcnt++].iov_len   = page_len;
+            len += sizeof(uint64_t) + page_len;
+        }
+
+        ssize_t ret = writev(fd, iov, iovcnt);
+        if (ret < 0 || (size_t)ret != len) {
+            /* Short writes are rare enough to not bother resuming */
+            failed = 1;
+        }
+    }
+
+    return publish(fd, tmp, job->dst_path, failed);
+}
+
+/**
+ * @brief Clears the soft-dirty bits of every page of the process
+ *
+ * The kernel has no per-range interface, so this resets the bits of every
+ * mapping of the process, not just the pool's: nothing else in the target
+ * may rely on soft-dirty tracking while `DELTA` mode is enabled.
+ *
+ * @return 0 on success, -1 on failure
+ */
+int imgsnap_clear_soft_dirty(void) {
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+    if (fd < 0)
+        return -1;
+    int ret = write_all(fd, "4", 1);
+    close(fd);
+    return ret;
+}
+
+/**
+ * @brief Collects the pages of [addr, addr+size) with the soft-dirty bit set
+ * @param pages Set to a malloc()ed array of page indices relative to addr
+ * @return Number of dirty pages, -1 on failure
+ */
+int64_t imgsnap_dirty_pages(const void *addr, size_t size,
+        uint32_t page_size, uint64_t **pages) {
+    uint64_t entries[PAGEMAP_BATCH];
+    uint64_t page_total = (size + page_size - 1)/page_size;
+    int64_t cnt = 0;
+
+    int fd = open("/proc/self/pagemap", O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    *pages = malloc(page_total*sizeof(uint64_t));
+    if (*pages == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    off_t off = ((uintptr_t)addr/page_size)*sizeof(uint64_t);
+    for (uint64_t base = 0; base < page_total; base += PAGEMAP_BATCH) {
+        uint64_t n = page_total - base;
+        if (n > PAGEMAP_BATCH)
+            n = PAGEMAP_BATCH;
+
+        ssize_t len = n*sizeof(uint64_t);
+        if (pread(fd, entries, len, off + base*sizeof(uint64_t)) != len) {
+            free(*pages);
+            close(fd);
+            return -1;
+        }
+
+        for (uint64_t i = 0; i < n; i++) {
+            if (entries[i] & PAGEMAP_SOFT_DIRTY)
+                (*pages)[cnt++] = base + i;
+        }
+    }
+
+    close(fd);
+    return cnt;
+}
+
+/**
+ * @brief Checks that the kernel tracks soft-dirty bits by dirtying a
+ * private page after clearing them
+ */
+static int soft_dirty_supported(void) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    volatile char *probe = mmap(NULL, page_size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (probe == MAP_FAILED)
+        return 0;
+
+    int result = 0;
+    uint64_t *pages = NULL;
+    probe[0] = 1;
+    if (imgsnap_clear_soft_dirty() == 0
+            && imgsnap_dirty_pages((char*)probe, page_size, page_size, &pages) == 0) {
+        free(pages);
+        probe[0] = 2;
+        result = imgsnap_dirty_pages((char*)probe, page_size, page_size, &pages) == 1;
+        free(pages);
+    }
+
+    munmap((void*)probe, page_size);
+    return result;
+}
+
+/**
+ * @brief Checks, once per process, if soft-dirty tracking is available
+ */
+int imgsnap_soft_dirty_ok(void) {
+    if (soft_dirty_ok < 0)
+        soft_dirty_ok = soft_dirty_supported();
+    return soft_dirty_ok;
+}
+
+/**
+ * @brief Ends the current delta chain, the next image is a full image
+ * Required whenever the pool is modified behind imgsnap's back, e.g., when
+ * it is restored between persistent mode iterations.
+ */
+void imgsnap_reset(void) {
+    delta_addr = NULL;
+    delta_size = 0;
+    delta_parent[0] = '\0';
+}
+
+/**
+ * @brief Writes a crash image of the pool without stalling the caller for a
+ * full copy
+ *
+ * If the pool is mapped privately (fake mmap), a child process writes the
+ * image from its copy-on-write view of the pool.  A shared mapping is backed
+ * by `src_path` itself, so the image is reflinked or copied in place.
+ *
+ * In `DELTA` mode, every image after the first one of a pool is written as
+ * a delta of the pages dirtied since the previous image, and
+ * IMGSNAP_DELTA_SUFFIX is appended to `dst_path`.
+ *
+ * @param src_path Pool file backing the mapping
+ * @param addr Starting address of the pool mapping
+ * @param size Size of the pool mapping
+ * @param private_map Non-zero if the mapping is not backed by src_path
+ * @param dst_path Path of the image to create, updated with the final name
+ * @param dst_len Size of the dst_path buffer
+ * @return 0 on success, -1 on failure
+ */
+int imgsnap_take(const char *src_path, void *addr, size_t size,
+        int private_map, char *dst_path, size_t dst_len) {
+    ImgSnapMode_t mode = imgsnap_get_mode();
+    uint32_t page_size = sysconf(_SC_PAGESIZE);
+    snap_job_t job = {
+        .dst_path   = dst_path,
+        .parent     = delta_parent,
+        .addr       = addr,
+        .size       = size,
+        .pages      = NULL,
+        .page_cnt   = 0,
+        .page_size  = page_size,
+    };
+
+    reap_children(IMGSNAP_MAX_CHILDREN, 0);
+
+    if (mode == ISM_DELTA && soft_dirty_ok < 0) {
+        if (!imgsnap_soft_dirty_ok())
+            dprintf(2, "[FI] Soft-dirty tracking unavailable, writing full "
+                "images\n");
+    }
+
+    if (mode == ISM_DELTA && soft_dirty_ok && delta_addr == addr
+            && delta_size == size
+            && strlen(dst_path) + strlen(IMGSNAP_DELTA_SUFFIX) < dst_len) {
+        int64_t cnt = imgsnap_dirty_pages(addr, size, page_size, &job.pages);
+        if (cnt >= 0 && imgsnap_clear_soft_dirty() == 0) {
+            strcat(dst_path, IMGSNAP_DELTA_SUFFIX);
+            job.page_cnt = cnt;
+
+            int ret = private_map
+                ? spawn_writer(write_delta_image, &job)
+                : write_delta_image(&job);
+            free(job.pages);
+
+            if (ret == 0)
+                snprintf(delta_parent, sizeof(delta_parent), "%s", dst_path);
+            return ret;
+        }
+        free(job.pages);
+        /* Fall through and start a new chain with a full image */
+    }
+
+    if (mode == ISM_DELTA && soft_dirty_ok)
+        imgsnap_clear_soft_dirty();
+
+    int ret;
+    if (private_map) {
+        ret = spawn_writer(write_full_image, &job);
+    } else {
+        /* The shared mapping keeps changing the file: copy before returning */
+        ret = imgsnap_copy_file(src_path, dst_path);
+    }
+
+    if (mode == ISM_DELTA) {
+        delta_addr = ret == 0 ? addr : NULL;
+        delta_size = size;
+        snprintf(delta_parent, sizeof(delta_parent), "%s", dst_path);
+    }
+    return ret;
+}
+
+/**
+ * @brief Checks if a file is a delta image
+ * @return 1 if path is a delta image, 0 otherwise
+ */
+int imgsnap_is_delta(const char *path) {
+    char magic[sizeof(((imgsnap_delta_hdr_t*)0)->magic)];
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    int result = read_all(fd, magic, sizeof(magic)) == 0
+        && memcmp(magic, IMGSNAP_DELTA_MAGIC, sizeof(magic)) == 0;
+    close(fd);
+    return result;
+}
+
+/**
+ * @brief Materializes a delta image, and recursively its parents, to a full
+ * image
+ * @param delta_path Path to the delta image
+ * @param out_path Path to write the full image to
+ * @return 0 on success, -1 on failure
+ */
+int imgsnap_apply_delta(const char *delta_path, const char *out_path) {
+    imgsnap_delta_hdr_t hdr;
+    char parent[PATH_MAX];
+    int result = -1;
+
+    int fd = open(delta_path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    if (read_all(fd, &hdr, sizeof(hdr)) != 0
+            || memcmp(hdr.magic, IMGSNAP_DELTA_MAGIC, sizeof(hdr.magic)) != 0
+            || hdr.parent_len >= sizeof(parent)
+            || read_all(fd, parent, hdr.parent_len) != 0) {
+        errno = EINVAL;
+        close(fd);
+        return -1;
+    }
+    parent[hdr.parent_len] = '\0';
+
+    /* Start from the materialized parent */
+    int ret = imgsnap_is_delta(parent)
+        ? imgsnap_apply_delta(parent, out_path)
+        : imgsnap_copy_file(parent, out_path);
+    if (ret != 0) {
+        close(fd);
+        return -1;
+    }
+
+    int out = open(out_path, O_WRONLY);
+    char *page = malloc(hdr.page_size);
+    if (out >= 0 && page != NULL && ftruncate(out, hdr.img_size) == 0) {
+        uint64_t i;
+        for (i = 0; i < hdr.page_cnt; i++) {
+            uint64_t idx;
+            if (read_all(fd, &idx, sizeof(idx)) != 0
+                    || idx*hdr.page_size >= hdr.img_size) {
+                break;
+            }
+
+            /* The last page is clamped to the end of the image */
+            size_t len = hdr.img_size - idx*hdr.page_size;
+            if (len > hdr.page_size)
+                len = hdr.page_size;
+            off_t off = idx*hdr.page_size;
+            if (read_all(fd, page, len) != 0
+                    || pwrite(out, page, len, off) != (ssize_t)len)
+                break;
+        }
+        result = (i == hdr.page_cnt) ? 0 : -1;
+    }
+
+    free(page);
+    if (out >= 0)
+        close(out);
+    close(fd);
+    return result;
+}
@@ -0,0 +1,81 @@
+/**
+ *  @file        imgsnap.h
+ *  @details     Non-blocking crash image snapshots for libpmfuzz
+ *
+ * Crash images are normally copied synchronously from the failure point,
+ * stalling the target for a full pool copy.  imgsnap moves the copy out of
+ * the target's critical path:
+ *
+ * 1. `FORK`:  A short-lived child process writes the image from its
+ *             copy-on-write view of the pool while the parent continues.
+ * 2. `DELTA`: Same as `FORK`, but after the first image of a pool only the
+ *             pages dirtied since the previous snapshot (tracked using the
+ *             kernel's soft-dirty bits) are written, as a delta against the
+ *             previous image.
+ *
+ * ### Delta format
+ * ```
+ * imgsnap_delta_hdr_t | parent path (parent_len bytes) |
+ *   page_cnt x { uint64_t page index | page_size bytes of data }
+ * ```
+ * The record of the last page of the image is clamped to img_size.  Pages
+ * not present in the delta are identical to the parent image, which may
+ * itself be a delta.  Use @ref imgsnap_apply_delta() to materialize, the
+ * stages materialize the images of every failure injection run with
+ * `interfaces/imgsnap.py`.
+ *
+ * Soft-dirty bits are cleared process-wide (`/proc/self/clear_refs`), so
+ * `DELTA` mode must not be combined with anything else in the target that
+ * uses them.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define IMGSNAP_ENV             "FI_SNAPSHOT"   /* Snapshot mode */
+#define IMGSNAP_DELTA_MAGIC     "PMFZDLT1"
+#define IMGSNAP_DELTA_SUFFIX    ".delta"
+
+/* Maximum number of snapshot children writing images at any time */
+#define IMGSNAP_MAX_CHILDREN    (8)
+
+/**
+ * @enum ImgSnapMode
+ * @brief Crash image snapshot mode, read from `FI_SNAPSHOT`
+ */
+typedef enum {
+    ISM_SYNC    = 0, /* Copy the image before returning (default) */
+    ISM_FORK    = 1, /* Child process writes the full image */
+    ISM_DELTA   = 2, /* Child process writes the dirty pages only */
+} ImgSnapMode_t;
+
+/**
+ * @brief Header of a delta image, followed by the parent path and the pages
+ */
+typedef struct {
+    char        magic[8];
+    uint64_t    img_size;   /* Size of the materialized image */
+    uint32_t    page_size;
+    uint32_t    parent_len; /* Length of the parent path, without NUL */
+    uint64_t    page_cnt;   /* Number of page records that follow */
+} imgsnap_delta_hdr_t;
+
+ImgSnapMode_t imgsnap_get_mode(void);
+
+int imgsnap_take(const char *src_path, void *addr, size_t size,
+    int private_map, char *dst_path, size_t dst_len);
+
+void imgsnap_wait_all(void);
+
+int imgsnap_is_delta(const char *path);
+int imgsnap_apply_delta(const char *delta_path, const char *out_path);
+int imgsnap_copy_file(const char *src_path, const char *dst_path);
+
+/* Soft-dirty page tracking, shared with pmrestore */
+int imgsnap_soft_dirty_ok(void);
+int imgsnap_clear_soft_dirty(void);
+int64_t imgsnap_dirty_pages(const void *addr, size_t size,
+    uint32_t page_size, uint64_t **pages);
+void imgsnap_reset(void);
@@ -52,4 +52,14 @@ void pmfuzz_term() {
 	return;
 }
 
+uint32_t __pmfuzz_failure_id = -1;
+
+void pmfuzz_register_sites(struct pmfuzz_site *start, struct pmfuzz_site *stop) {
+	return;
+}
+
+void pmfuzz_register_hints(volatile uint32_t *start, volatile uint32_t *stop) {
+	return;
+}
+
 #pragma GCC diagnostic pop
@@ -14,6 +14,9 @@
  */
 
 #include "pmfuzz.h"
+#include "pmfuzz_config.h"
+#include "imgsnap.h"
+#include "pmrestore.h"
 #include "rtinfo.h"
 
 #include <assert.h>
@@ -48,7 +51,11 @@ extern uint8_t      *__pmfuzz_area_ptr;
 extern uint32_t     __pmfuzz_map_size;
 extern uint32_t     __pmfuzz_prev_loc;
 
-extern uint8_t      *__last_pmfuzz_area_ptr;
+/* Set when the map changes, cleared when a crash image is taken */
+extern uint8_t      __pmfuzz_map_dirty;
+
+/* Set once the fuzzer was told the map size, which is then fixed */
+extern uint8_t      __pmfuzz_map_final;
 
 /* Maximum number of failure point allowed. No crash image generate if exceed 
    this number */
@@ -59,9 +66,28 @@ extern uint8_t      *__last_pmfuzz_area_ptr;
 /* Failure point variables */
 uint8_t             pmfuzz_init_complete = 0;
 uint32_t            __pmfuzz_failure_id = -1; // Initialize to -1
-uint8_t             failure_list[MAX_FAILURE_COUNT];
 FILE*               failure_list_file;
 
+/* Serializes the failure points of concurrent threads */
+static pthread_mutex_t inject_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* IMG_REP: bitmap of the failure ids to reproduce, indexed by failure id */
+uint8_t             failure_list[(MAX_FAILURE_COUNT + 7)/8];
+/* IMG_REP: last failure id to reproduce, -1 if none */
+int32_t             failure_list_last = -1;
+
+static inline int failure_listed(uint32_t id) {
+    return id < MAX_FAILURE_COUNT && (failure_list[id/8] & (1 << (id%8)));
+}
+
+/* Failure point counters, written to the PMFUZZ_STATS file at exit */
+uint32_t            __pmfuzz_fp_reached = 0;
+uint32_t            __pmfuzz_fp_images = 0;
+uint32_t            __pmfuzz_fp_unchanged = 0;
+
+/* AFL forkserver entry point, weak so targets run without the AFL runtime */
+void __afl_manual_init(void) __attribute__((weak));
+
 /* Env variables */
 #define FI_MODE_ENV         "FI_MODE"       /* Failure injection mode */
 #define FAILURE_LIST_ENV    "FAILURE_LIST"  /* File to write failure ids */
@@ -69,6 +95,10 @@ FILE*               failure_list_file;
 #define FI_IMG_SUFFIX_ENV   "FI_IMG_SUFFIX" /* Suffix for crash sites */
 #define GEN_ALL_CS_ENV      "GEN_ALL_CS"    /* Makes selection probability 1 */
 #define IMG_CREAT_FINJ_ENV  "IMG_CREAT_FINJ"/* Enables all images for failure inj during creation */
+#define DEFER_FORKSRV_ENV   "PMFUZZ_DEFER_FORKSRV" /* Start forkserver from pmfuzz_init() */
+#define PMFUZZ_STATS_ENV    "PMFUZZ_STATS"  /* File to append failure point counts to */
+#define PMFUZZ_SITES_ENV    "PMFUZZ_SITES"  /* Failure point sites to enable */
+#define PMFUZZ_SITES_LIST_ENV "PMFUZZ_SITES_LIST" /* File to list the sites in */
 
 /* Modes for failure injection */
 #define TEST_MODE           "TEST"          /* Run on top of testing tool */
@@ -76,16 +106,46 @@ FILE*               failure_list_file;
 #define IMG_GEN_MODE        "IMG_GEN"       /* Generate crash image */
 #define IMG_REP_MODE        "IMG_REP"       /* Reproduce image */
 
+/* PMFUZZ_DEBUG, read on first use */
+static int debug_on = -1;
+
+static inline int debug_check(void) {
+    if (debug_on < 0) {
+        debug_on = getenv(PMFUZZ_DEBUG_ENV) 
+            && strcmp("1", getenv(PMFUZZ_DEBUG_ENV)) == 0;
+    }
+    return debug_on;
+}
+
 #define debug(...) do {\
-    if (getenv(PMFUZZ_DEBUG_ENV)) {\
-        if (strcmp("1", getenv(PMFUZZ_DEBUG_ENV)) == 0) {\
-            dprintf(2, __VA_ARGS__);\
-        }\
+    if (debug_check()) {\
+        dprintf(2, __VA_ARGS__);\
     }\
 } while(0);
 
-#define debug_enabled (getenv(PMFUZZ_DEBUG_ENV) && \
-        strcmp("1", getenv(PMFUZZ_DEBUG_ENV)) == 0)
+#define debug_enabled debug_check()
+
+/* Failure injection switches, read once by fi_env_read() */
+static int          post_failure = 0;
+static int          gen_all_cs = 0;
+static int          img_creat_finj = 0;
+static const char  *fi_img_suffix = "";
+
+/**
+ * @brief Reads the environment of the failure points
+ * Runs as a constructor so the failure points never read the environment,
+ * see update_loc_select().
+ * @return void
+ */
+__attribute__((constructor))
+static void fi_env_read(void) {
+    post_failure    = getenv("POST_FAILURE") != NULL;
+    gen_all_cs      = getenv(GEN_ALL_CS_ENV) != NULL;
+    img_creat_finj  = getenv(IMG_CREAT_FINJ_ENV) != NULL;
+
+    if (getenv(FI_IMG_SUFFIX_ENV) != NULL)
+        fi_img_suffix = getenv(FI_IMG_SUFFIX_ENV);
+}
 
 /**
  * @enum FIMode
@@ -111,88 +171,324 @@ uint32_t get_next_pow_2(uint32_t val) {
 }
 
 /**
- * @brief Updates a single element in the whole map
+ * @brief Updates the saturating hit counter of the hint site at loc
+ * (`ENABLE_PM_PATH`)
  * @param loc Location of the element to update
  * @return void
-*/
-void update_loc(uint32_t loc) {
-    if (getenv("ENABLE_PM_PATH") != NULL) {
-        uint32_t elem_id = loc;
+ */
+static void update_loc_path(uint32_t loc) {
+    if (__pmfuzz_area_ptr[loc] < COUNTER_CAP) {
+        __pmfuzz_area_ptr[loc]++;
+        __pmfuzz_map_dirty = 1;
+    }
+}
 
-        uint32_t cur_loc = elem_id^__pmfuzz_prev_loc;
-        __pmfuzz_prev_loc = elem_id>>1;
+/**
+ * @brief Updates the shift register at loc (baseline)
+ * @param loc Location of the element to update
+ * @return void
+ */
+static void update_loc_sra(uint32_t loc) {
+    uint32_t elem_id = (loc)%(__pmfuzz_map_size/__pmfuzz_sra_elem_size-97);
+
+    uint32_t cur_loc = elem_id^__pmfuzz_prev_loc;
+    __pmfuzz_prev_loc = elem_id>>1;
+
+    __pmfuzz_map_dirty |= sra_push_back(__pmfuzz_area_ptr, __pmfuzz_map_size,
+        __pmfuzz_sra_elem_size, cur_loc, 0);
+}
 
-        if (__pmfuzz_area_ptr[cur_loc] < COUNTER_CAP) {
-            __pmfuzz_area_ptr[cur_loc]++;
+/* Multithreaded coverage (`PMFUZZ_MT_COVERAGE`): every thread counts its
+   hint site hits in its own shard of the map, merged into __pmfuzz_area_ptr
+   before injecting failures, at exit and on crashes */
+#define MT_COVERAGE_ENV     "PMFUZZ_MT_COVERAGE"
+
+/* Threads past this share the overflow shard, updated atomically */
+#define MAX_SHARDS          64
+
+typedef struct {
+    uint8_t *map;       /* PMFUZZ_MAP_SIZE counters, written by the owner */
+    uint8_t  dirty;     /* Set by the owner, cleared by the merge */
+    uint8_t  free;      /* Owner exited, counters are kept */
+} __attribute__((aligned(64))) pm_shard_t;
+
+static pm_shard_t       shards[MAX_SHARDS + 1];
+#define OVERFLOW_SHARD  (&shards[MAX_SHARDS])
+static uint32_t         shard_cnt = 0;
+static pthread_mutex_t  shard_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t  merge_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t    shard_key;
+static int              mt_on = 0;
+
+static __thread pm_shard_t *my_shard
+    __attribute__((tls_model("initial-exec"))) = NULL;
+
+/* Thread exit: the next thread reuses the shard and its counters */
+static void shard_release(void *shard) {
+    if (shard == OVERFLOW_SHARD)
+        return;
+    pthread_mutex_lock(&shard_lock);
+    ((pm_shard_t*)shard)->free = 1;
+    pthread_mutex_unlock(&shard_lock);
+}
+
+/* Assigns the calling thread a shard, on its first hint */
+static pm_shard_t *shard_attach(void) {
+    pm_shard_t *shard = NULL;
+
+    pthread_mutex_lock(&shard_lock);
+    for (uint32_t i = 0; i < shard_cnt && !shard; i++) {
+        if (shards[i].free) {
+            shard = &shards[i];
+            shard->free = 0;
         }
-    } else { // For baseline
-        if (__pmfuzz_sra_elem_size == 0) {
-            __pmfuzz_sra_elem_size = get_next_pow_2(COUNTER_CAP/8);
-            printf("%u -> %u\n", (COUNTER_CAP/8), __pmfuzz_sra_elem_size);
+    }
+    if (!shard && shard_cnt < MAX_SHARDS) {
+        uint8_t *map = calloc(PMFUZZ_MAP_SIZE, 1);
+        if (map) {
+            shard = &shards[shard_cnt];
+            shard->map = map;
+            /* Published last, the merge reads shards[0..shard_cnt) */
+            __atomic_store_n(&shard_cnt, shard_cnt + 1, __ATOMIC_RELEASE);
+        }
+    }
+    if (!shard)
+        shard = OVERFLOW_SHARD;
+    pthread_mutex_unlock(&shard_lock);
+
+    pthread_setspecific(shard_key, shard);
+    my_shard = shard;
+    return shard;
+}
+
+/**
+ * @brief Updates the saturating hit counter of the hint site at loc in the
+ * shard of the calling thread (`PMFUZZ_MT_COVERAGE`)
+ * @param loc Location of the element to update
+ * @return void
+ */
+static void update_loc_mt(uint32_t loc) {
+    pm_shard_t *shard = my_shard;
+    if (__builtin_expect(shard == NULL, 0))
+        shard = shard_attach();
+
+    uint8_t *cnt = &shard->map[loc];
+    uint8_t val = __atomic_load_n(cnt, __ATOMIC_RELAXED);
+    if (val >= COUNTER_CAP)
+        return;
+
+    if (__builtin_expect(shard == OVERFLOW_SHARD, 0)) {
+        while (val < COUNTER_CAP && !__atomic_compare_exchange_n(cnt, &val,
+                val + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    } else {
+        __atomic_store_n(cnt, val + 1, __ATOMIC_RELAXED);
+    }
+    if (!__atomic_load_n(&shard->dirty, __ATOMIC_RELAXED))
+        __atomic_store_n(&shard->dirty, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Merges the shards into __pmfuzz_area_ptr if any changed since the
+ * last merge. Counters only grow, an element is raised to the saturated sum
+ * of its shards, so the merges of a forked child keep the parent's counts.
+ * @param wait Wait for a merge running in another thread instead of skipping
+ * @return 1 if the map was updated, 0 otherwise
+ */
+static int mt_merge(int wait) {
+    if (wait) {
+        pthread_mutex_lock(&merge_lock);
+    } else if (pthread_mutex_trylock(&merge_lock) != 0) {
+        return 0;
+    }
+
+    uint32_t cnt = __atomic_load_n(&shard_cnt, __ATOMIC_ACQUIRE);
+    int dirty = __atomic_exchange_n(&OVERFLOW_SHARD->dirty, 0,
+        __ATOMIC_ACQUIRE);
+    for (uint32_t i = 0; i < cnt; i++)
+        dirty |= __atomic_exchange_n(&shards[i].dirty, 0, __ATOMIC_ACQUIRE);
+
+    int updated = 0;
+    if (dirty) {
+        for (uint32_t loc = 0; loc < __pmfuzz_map_size; loc++) {
+            uint32_t sum = __atomic_load_n(&OVERFLOW_SHARD->map[loc],
+                __ATOMIC_RELAXED);
+            for (uint32_t i = 0; i < cnt; i++)
+                sum += __atomic_load_n(&shards[i].map[loc], __ATOMIC_RELAXED);
+            if (sum > COUNTER_CAP)
+                sum = COUNTER_CAP;
+            if (sum > __pmfuzz_area_ptr[loc]) {
+                __pmfuzz_area_ptr[loc] = sum;
+                updated = 1;
+            }
         }
+    }
 
-        uint32_t elem_id = (loc)%(__pmfuzz_map_size/__pmfuzz_sra_elem_size-97);
+    pthread_mutex_unlock(&merge_lock);
+    return updated;
+}
 
-        uint32_t cur_loc = elem_id^__pmfuzz_prev_loc;
-        __pmfuzz_prev_loc = elem_id>>1;
+/* Clears the counters of every shard, for a new execution */
+static void mt_reset(void) {
+    uint32_t cnt = __atomic_load_n(&shard_cnt, __ATOMIC_ACQUIRE);
+    for (uint32_t i = 0; i <= cnt; i++) {
+        pm_shard_t *shard = i == cnt ? OVERFLOW_SHARD : &shards[i];
+        memset(shard->map, 0, __pmfuzz_map_size);
+        shard->dirty = 0;
+    }
+}
 
-        sra_push_back(__pmfuzz_area_ptr, __pmfuzz_map_size, __pmfuzz_sra_elem_size, cur_loc, 0);
+/* Forked child: only the forking thread exists, the other threads' shards
+   and locks are taken over as they were at fork() */
+static void mt_atfork_child(void) {
+    pthread_mutex_init(&shard_lock, NULL);
+    pthread_mutex_init(&merge_lock, NULL);
+    pthread_mutex_init(&inject_lock, NULL);
+
+    mt_reset();
+    for (uint32_t i = 0; i < shard_cnt; i++) {
+        if (&shards[i] != my_shard)
+            shards[i].free = 1;
     }
 }
 
+/* Crash: merges the coverage of the run, which the destructor would have
+   done, and dies of the same signal.  Skipped if the crashing thread was
+   merging already. */
+static void mt_fatal_signal(int sig) {
+    mt_merge(0);
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+/* Sets up the shards, returns 0 if the mode cannot be used */
+static int mt_setup(void) {
+    const int fatal_sigs[] = {SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT};
+
+    OVERFLOW_SHARD->map = calloc(PMFUZZ_MAP_SIZE, 1);
+    if (OVERFLOW_SHARD->map == NULL
+            || pthread_key_create(&shard_key, shard_release) != 0) {
+        perror("[PM] Cannot set up " MT_COVERAGE_ENV);
+        return 0;
+    }
+    pthread_atfork(NULL, NULL, mt_atfork_child);
+
+    /* Leave the handlers of the target (or sanitizers) alone */
+    for (size_t i = 0; i < sizeof(fatal_sigs)/sizeof(fatal_sigs[0]); i++) {
+        struct sigaction old, sa;
+        if (sigaction(fatal_sigs[i], NULL, &old) != 0
+                || old.sa_handler != SIG_DFL) {
+            continue;
+        }
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = mt_fatal_signal;
+        sa.sa_flags = SA_RESETHAND;
+        sigaction(fatal_sigs[i], &sa, NULL);
+    }
+
+    mt_on = 1;
+    return 1;
+}
+
+static void update_loc_resolve(uint32_t loc);
+
+/* Map update used by the hints, resolved on first use */
+static void (*update_loc_fn)(uint32_t) = update_loc_resolve;
+
+/**
+ * @brief Selects the map update for the process from `ENABLE_PM_PATH` and
+ * `PMFUZZ_MT_COVERAGE`
+ * Runs as a constructor so the hints never read the environment; hints
+ * executed by earlier constructors resolve it through update_loc_resolve().
+ * @return void
+ */
+__attribute__((constructor))
+static void update_loc_select(void) {
+    if (update_loc_fn != update_loc_resolve)
+        return;
+
+    if (getenv("ENABLE_PM_PATH") != NULL) {
+        update_loc_fn = update_loc_path;
+        if (getenv(MT_COVERAGE_ENV) != NULL && mt_setup())
+            update_loc_fn = update_loc_mt;
+    } else { // For baseline
+        if (getenv(MT_COVERAGE_ENV) != NULL)
+            dprintf(2, "[PM] " MT_COVERAGE_ENV " requires ENABLE_PM_PATH\n");
+        __pmfuzz_sra_elem_size = get_next_pow_2(COUNTER_CAP/8);
+        debug("[PM] SRA element size %u -> %u\n", (COUNTER_CAP/8), 
+              __pmfuzz_sra_elem_size);
+        update_loc_fn = update_loc_sra;
+    }
+}
+
+static void update_loc_resolve(uint32_t loc) {
+    update_loc_select();
+    update_loc_fn(loc);
+}
+
+/**
+ * @brief Updates a single element in the whole map
+ * @param loc Location of the element to update
+ * @return void
+*/
+void update_loc(uint32_t loc) {
+    update_loc_fn(loc);
+}
+
 /** 
  * @brief Hint for a read-only PM access
- * @param rand A compile time random number for identifying a code location
+ * @param rand ID of the hint site, see PMFUZZ_HINT_SITE
  *
- * **NOTE:** First half of the map is for reads, second half for writes 
+ * **NOTE:** First half of the map is for reads, second half for writes.
+ * The map size is a power of 2, IDs of unregistered sites are masked into
+ * the half.
  * @return void
  */
 void pmfuzz_ro(uint32_t rand) {
-    uint32_t loc = rand%(__pmfuzz_map_size/2);
+    uint32_t loc = rand & (__pmfuzz_map_size/2 - 1);
 
     /* Update the map */
-    update_loc(loc);
+    update_loc_fn(loc);
 
     return;
 }
 
 /** 
  * @brief Hint for a write-only PM access
- * @param rand A compile time random number for identifying a code location
+ * @param rand ID of the hint site, see PMFUZZ_HINT_SITE
  *
  * **NOTE:** First half of the map is for reads, second half for writes 
  * @return void
  */
 void pmfuzz_wo(uint32_t rand) {
-    uint32_t loc = rand%((__pmfuzz_map_size/2)-97);
+    uint32_t loc = rand & (__pmfuzz_map_size/2 - 1);
 
     /* Upper half of the map */
     loc += __pmfuzz_map_size/2;
 
     /* Update the map */
-    update_loc(loc);
+    update_loc_fn(loc);
     
     return;
 }
 
 /** 
  * @brief Hint for a read-write PM access
- * @param rand A compile time random number for identifying a code location
+ * @param rand ID of the hint site, see PMFUZZ_HINT_SITE
  *
  * **NOTE:** First half of the map is for reads, second half for writes 
  * @return void
  */
 void pmfuzz_rw(uint32_t rand) {
-    uint32_t loc = rand%((__pmfuzz_map_size/2)-97);
+    uint32_t loc = rand & (__pmfuzz_map_size/2 - 1);
 
     /* Update the map for read */
-    update_loc(loc);
+    update_loc_fn(loc);
 
     /* Go to upper half of the map */
     loc += __pmfuzz_map_size/2;
 
     /* Update the map for write */
-    update_loc(loc);
+    update_loc_fn(loc);
 
     return;
 }
@@ -204,6 +500,11 @@ void pmfuzz_rw(uint32_t rand) {
  * @return FI_MODE value corresponding to the env var
  */
 FIMode_t get_fi_mode() {
+    /* The environment is checked once */
+    static FIMode_t cached = FIM_MAX;
+    if (cached != FIM_MAX)
+        return cached;
+
     char* mode_str = getenv(FI_MODE_ENV);
     FIMode_t result = FIM_NONE;
     if (mode_str == NULL) {
@@ -227,15 +528,305 @@ FIMode_t get_fi_mode() {
         }
     }
     
+    cached = result;
     return result;
 }
 
+/* Maximum number of binaries and libraries with failure point sites */
+#define MAX_SITE_RANGES 64
+
+/* Sites registered by each binary or library */
+static struct {
+    struct pmfuzz_site *start;
+    struct pmfuzz_site *stop;
+} site_ranges[MAX_SITE_RANGES];
+static int site_range_cnt = 0;
+
+/* Site selection from PMFUZZ_SITES */
+typedef enum {
+    SITES_UNRESOLVED,
+    SITES_ALL,
+    SITES_NONE,
+    SITES_LISTED,
+} SitesPolicy_t;
+
+static SitesPolicy_t sites_policy = SITES_UNRESOLVED;
+
+/* Sites enabled by a PMFUZZ_SITES file */
+static struct {
+    char        *file;
+    uint32_t    line;
+} *listed_sites = NULL;
+static size_t listed_site_cnt = 0;
+
+/**
+ * @brief Reads the file of enabled sites, one `<file>:<line>` per line
+ * @return void
+ */
+static void read_sites_file(const char *path) {
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        dprintf(2, "Cannot open " PMFUZZ_SITES_ENV " file %s\n", path);
+        exit(1);
+    }
+
+    size_t cap = 0;
+    char buf[4096];
+    while (fgets(buf, sizeof(buf), in) != NULL) {
+        char *sep = strrchr(buf, ':');
+        if (buf[0] == '#' || sep == NULL)
+            continue;
+        *sep = '\0';
+
+        if (listed_site_cnt == cap) {
+            cap = cap ? cap*2 : 64;
+            listed_sites = realloc(listed_sites, cap*sizeof(*listed_sites));
+            assert(listed_sites && "Out of memory");
+        }
+        listed_sites[listed_site_cnt].file = strdup(buf);
+        listed_sites[listed_site_cnt].line = strtoul(sep + 1, NULL, 10);
+        listed_site_cnt++;
+    }
+    fclose(in);
+}
+
+/**
+ * @brief Reads `PMFUZZ_SITES`
+ * @return void
+ */
+static void resolve_sites_policy(void) {
+    char *sites = getenv(PMFUZZ_SITES_ENV);
+
+    if (sites == NULL || strcmp(sites, "") == 0) {
+        /* Failure points only do something with failure injection */
+        sites_policy = get_fi_mode() == FIM_NONE ? SITES_NONE : SITES_ALL;
+    } else if (strcmp(sites, "all") == 0) {
+        sites_policy = SITES_ALL;
+    } else if (strcmp(sites, "none") == 0) {
+        sites_policy = SITES_NONE;
+    } else {
+        read_sites_file(sites);
+        sites_policy = SITES_LISTED;
+    }
+}
+
+/**
+ * @brief Checks if a site is in the PMFUZZ_SITES file, file names match if
+ * the site's file name ends with the listed one at a path component
+ * @return 1 if listed, 0 otherwise
+ */
+static int site_listed(const struct pmfuzz_site *site) {
+    size_t file_len = strlen(site->file);
+
+    for (size_t i = 0; i < listed_site_cnt; i++) {
+        size_t len = strlen(listed_sites[i].file);
+        if (listed_sites[i].line != site->line || len > file_len)
+            continue;
+
+        const char *tail = site->file + file_len - len;
+        if (strcmp(tail, listed_sites[i].file) == 0 
+                && (tail == site->file || tail[-1] == '/'))
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Registers the failure point sites of a binary or library and sets
+ * their enabled flags, called by constructors the hint header adds to every
+ * translation unit
+ *
+ * ### Environment variables read
+ * 1. `PMFUZZ_SITES={<empty or unset>|all|none|<path>}`: Sites to enable. 
+ *    If unset, all sites are enabled if failure injection is, see 
+ *    @ref pmfuzz_inject_failure(). A path names a file listing the enabled
+ *    sites, one `<file>:<line>` per line; the file may be in /dev/shm.
+ * 2. `PMFUZZ_SITES_LIST=<path>`: Appends every registered site to this 
+ *    file, as `<file>:<line> <enabled>`.
+ *
+ * Disabled sites still count failure points, so failure IDs do not depend
+ * on the enabled sites.
+ * @param start First site of the binary or library
+ * @param stop End of the sites of the binary or library
+ * @return void
+ */
+void pmfuzz_register_sites(struct pmfuzz_site *start, struct pmfuzz_site *stop) {
+    for (int i = 0; i < site_range_cnt; i++) {
+        if (site_ranges[i].start == start)
+            return;
+    }
+    if (site_range_cnt == MAX_SITE_RANGES) {
+        /* Sites stay enabled */
+        dprintf(2, "[FI] Too many libraries with failure point sites\n");
+        return;
+    }
+    site_ranges[site_range_cnt].start = start;
+    site_ranges[site_range_cnt].stop = stop;
+    site_range_cnt++;
+
+    if (sites_policy == SITES_UNRESOLVED)
+        resolve_sites_policy();
+
+    FILE *list = NULL;
+    if (getenv(PMFUZZ_SITES_LIST_ENV) != NULL)
+        list = fopen(getenv(PMFUZZ_SITES_LIST_ENV), "a");
+
+    for (struct pmfuzz_site *site = start; site < stop; site++) {
+        switch (sites_policy) {
+            case SITES_NONE:
+                site->enabled = 0;
+                break;
+            case SITES_LISTED:
+                site->enabled = site_listed(site);
+                break;
+            default:
+                site->enabled = 1;
+                break;
+        }
+        if (list != NULL)
+            fprintf(list, "%s:%u %u\n", site->file, site->line, site->enabled);
+    }
+
+    if (list != NULL)
+        fclose(list);
+    debug("[FI] Registered %ld failure point sites\n", (long)(stop - start));
+}
+
+/* Hint sites registered by each binary or library, with the stable IDs
+   their slots held before registration */
+static struct {
+    volatile uint32_t   *start;
+    volatile uint32_t   *stop;
+    uint32_t            *stable_ids;
+} hint_ranges[MAX_SITE_RANGES];
+static int hint_range_cnt = 0;
+static uint32_t hint_cnt = 0;
+
+/* Hint site in the order IDs are assigned */
+typedef struct {
+    uint32_t stable_id;
+    uint32_t range;
+    uint32_t idx;
+} hint_key_t;
+
+static int hint_key_cmp(const void *a, const void *b) {
+    const hint_key_t *x = a, *y = b;
+
+    if (x->stable_id != y->stable_id)
+        return x->stable_id < y->stable_id ? -1 : 1;
+    if (x->range != y->range)
+        return x->range < y->range ? -1 : 1;
+    return x->idx < y->idx ? -1 : (x->idx > y->idx);
+}
+
+/* Numbers the registered sites from 1 in the order of their stable IDs, so
+   a site gets the same ID whatever order the libraries register in */
+static void hint_assign_ids(void) {
+    hint_key_t *keys = malloc(hint_cnt * sizeof(*keys));
+    if (keys == NULL) {
+        perror("[PM] Cannot number hint sites");
+        exit(1);
+    }
+
+    uint32_t n = 0;
+    for (int r = 0; r < hint_range_cnt; r++) {
+        uint32_t cnt = hint_ranges[r].stop - hint_ranges[r].start;
+        for (uint32_t i = 0; i < cnt; i++)
+            keys[n++] = (hint_key_t){hint_ranges[r].stable_ids[i], r, i};
+    }
+    qsort(keys, n, sizeof(*keys), hint_key_cmp);
+
+    uint32_t max_id = PMFUZZ_MAP_SIZE/2 - 1;
+    for (uint32_t i = 0; i < n; i++)
+        hint_ranges[keys[i].range].start[keys[i].idx] 
+            = i < max_id ? i + 1 : 0;
+    if (n > max_id)
+        dprintf(2, "[PM] %u hint sites do not fit the PM map, %u share ID 0\n",
+            n, n - max_id);
+
+    free(keys);
+}
+
+/**
+ * @brief Registers the PM access hint sites of a binary or library, called
+ * by the constructors the hint header adds to every translation unit and by
+ * the AFL runtime before it starts the forkserver
+ *
+ * Sites are numbered from 1 in the order of the stable IDs their slots are
+ * initialized with (see PMFUZZ_HINT_SITE), ties broken by registration
+ * order, so IDs only depend on the set of sites. ID 0 is shared by the
+ * sites that could not get an ID of their own.
+ *
+ * With `ENABLE_PM_PATH`, the map holds one counter per site for reads and
+ * one for writes, and is sized to fit them, rounded up to a power of 2. The
+ * AFL runtime reports the size to the fuzzer when the forkserver starts.
+ * Sites registered later (e.g., by dlopen()) are reported and get ID 0.
+ * The baseline shift register mode keeps the whole map.
+ * @param start First site of the binary or library
+ * @param stop End of the sites of the binary or library
+ * @return void
+ */
+void pmfuzz_register_hints(volatile uint32_t *start, volatile uint32_t *stop) {
+    for (int i = 0; i < hint_range_cnt; i++) {
+        if (hint_ranges[i].start == start)
+            return;
+    }
+    if (hint_range_cnt == MAX_SITE_RANGES) {
+        dprintf(2, "[PM] Too many libraries with hint sites, %ld sites share "
+            "ID 0\n", (long)(stop - start));
+        for (volatile uint32_t *hint = start; hint < stop; hint++)
+            *hint = 0;
+        return;
+    }
+
+    uint32_t cnt = stop - start;
+    hint_ranges[hint_range_cnt].start = start;
+    hint_ranges[hint_range_cnt].stop = stop;
+
+    if (__pmfuzz_map_final) {
+        /* Kept to ignore repeats. Numbering the sites now would change
+           the IDs the fuzzer already saw. */
+        hint_ranges[hint_range_cnt++].stable_ids = NULL;
+        dprintf(2, "[PM] %u hint sites registered after the PM map was "
+            "fixed, they share ID 0\n", cnt);
+        for (volatile uint32_t *hint = start; hint < stop; hint++)
+            *hint = 0;
+        return;
+    }
+
+    uint32_t *stable_ids = malloc(cnt * sizeof(*stable_ids));
+    if (stable_ids == NULL) {
+        perror("[PM] Cannot register hint sites");
+        exit(1);
+    }
+    for (uint32_t i = 0; i < cnt; i++)
+        stable_ids[i] = start[i];
+    hint_ranges[hint_range_cnt++].stable_ids = stable_ids;
+    hint_cnt += cnt;
+
+    hint_assign_ids();
+
+    update_loc_select();
+    if (update_loc_fn == update_loc_path || update_loc_fn == update_loc_mt) {
+        uint32_t size = get_next_pow_2(2*(hint_cnt + 1));
+        if (size < PMFUZZ_MAP_SIZE_MIN)
+            size = PMFUZZ_MAP_SIZE_MIN;
+        if (size > PMFUZZ_MAP_SIZE)
+            size = PMFUZZ_MAP_SIZE;
+        __pmfuzz_map_size = size;
+    }
+    debug("[PM] Registered %u hint sites, map size %u\n", 
+        cnt, __pmfuzz_map_size);
+}
+
+static void inject_failure_at(uint32_t id, FIMode_t mode);
+
 /**
  * @brief Injects a failure point, creating a copy of the PM pool
  * Failure injection works in three modes:
  * 1. `None`: No failure point is injected
  * 2. `IMG_GEN`: Generates crash sites (imgs) by injecting a failure point 
- * 3. `IMG_REP`: todo
+ * 3. `IMG_REP`: Reproduces the crash sites of a list of failure ids
  *
  * **NOTE:** Atleast one call to @ref pmfuzz_init() is required before a failure 
  * image will be generated.
@@ -244,6 +835,12 @@ FIMode_t get_fi_mode() {
  * 1. `FI_MODE={<empty or unset>|IMG_GEN|IMG_REP}`
  * 2. `FAILURE_LIST=<path to file to write failure ids to>`
  * 3. `FI_IMG_SUFFIX=<suffix>`: Used for suffixing generated crash sites.
+ * 4. `FI_SNAPSHOT={<empty or unset>|SYNC|FORK|DELTA}`: How images are 
+ *    written, see imgsnap.h. In `DELTA` mode images after the first one are
+ *    named `<image name>.delta`.
+ * 5. `PMFUZZ_STATS=<path>`: In `IMG_GEN` mode, a line with the number of
+ *    failure points, images and failure points skipped because the PM map
+ *    was unchanged is appended to this file at exit.
  *
  * ### Modes
  * #### 1. None
@@ -260,7 +857,12 @@ FIMode_t get_fi_mode() {
  * the falure ids that generate dumps are written to that file, one per line.
  *
  * #### 3. IMG_REP
- * todo
+ * Reproduces crash sites instead of storing them: the images of the failure
+ * ids listed in the failure list file (one per line, as written by 
+ * `IMG_GEN`) are dumped with the same names `IMG_GEN` gives them. Requires a
+ * deterministic target (`ENABLE_CNST_IMG`) run with the same testcase and 
+ * image that generated the list. The target exits once the last listed 
+ * image is written.
  *
  * ### Environment variables set by @ref `pmfuzz_init()`
  * 1. `PM_ADDR=<starting address of PM pool>`
@@ -269,14 +871,13 @@ FIMode_t get_fi_mode() {
  * @return void
  */
 void pmfuzz_inject_failure(char* file, int line) {
-    uint8_t inject_failure = 0;
-
-    /* Always increment failure ID first */
-    __pmfuzz_failure_id++;
+    /* Always increment failure ID first, failure points reached by
+       concurrent threads get distinct IDs */
+    uint32_t id = __atomic_add_fetch(&__pmfuzz_failure_id, 1, __ATOMIC_RELAXED);
 
     // Debugging
-    if (!getenv("POST_FAILURE"))
-        debug("[FI] Failure ID %d at %s : %d\n", __pmfuzz_failure_id, file, line);
+    if (!post_failure)
+        debug("[FI] Failure ID %d at %s : %d\n", id, file, line);
 
     // Debugging
     debug("[FI] Failure injection: pm_addr   = %s\n", getenv("PM_ADDR"));
@@ -291,17 +892,38 @@ void pmfuzz_inject_failure(char* file, int line) {
 
     FIMode_t mode = get_fi_mode();
     debug("Mode = %d\n", mode)
+    if (mode == FIM_NONE) {
+        /* The map is merged at exit, when the AFL runtime reports, or on a
+           crash (mt_fatal_signal()) */
+        return;
+    }
+
+    /* Failure points of concurrent threads are injected one at a time */
+    pthread_mutex_lock(&inject_lock);
+    if (mt_on)
+        __pmfuzz_map_dirty |= mt_merge(1);
+    inject_failure_at(id, mode);
+    pthread_mutex_unlock(&inject_lock);
+}
+
+/**
+ * @brief Injects the failure point with the given failure id, called with
+ * inject_lock held
+ * @param id Failure id of the failure point
+ * @param mode Failure injection mode, other than `FIM_NONE`
+ * @return void
+ */
+static void inject_failure_at(uint32_t id, FIMode_t mode) {
+    uint8_t inject_failure = 0;
+
+    __pmfuzz_fp_reached++;
     switch (mode) {
-        case FIM_NONE: {
-            /* Failure injection is disabled */
-            return;
-        } 
         case FIM_IMG_REP: {
             /* Generate PM image according to failure list:
                 1. Program reproduces PM image (IMG_REP_MODE):
                     Only the failure ID in the list will lead to an image 
                     (Use computation to save storage overhead) */
-            if (failure_list[__pmfuzz_failure_id]) {
+            if (failure_listed(id)) {
                 /* Enable failure point injection */
                 inject_failure = 1;
             } else {
@@ -312,43 +934,46 @@ void pmfuzz_inject_failure(char* file, int line) {
         case FIM_IMG_GEN:  {
             /* Genearte PM image if PM bitmap has changed:
                 1. Program generates PM image (IMG_GEN_MODE):
-                    Only when PM bitmap has changed */
-            int pm_bitmap_diff = memcmp(__pmfuzz_area_ptr, 
-                __last_pmfuzz_area_ptr, __pmfuzz_map_size);
+                    Only when PM bitmap has changed. Map counters only 
+                    grow (saturating counters, shift registers), so the map
+                    differs from the one at the last image iff it was 
+                    updated since. */
+            int pm_bitmap_diff = __pmfuzz_map_dirty;
 
             /* Decrease the probablity of a selecting a failure point as the 
             failure id increases until MAX_CRASH_DUMP_ID. Probability is 0 
             after that. */
             uint32_t prob = rand()%MAX_CRASH_DUMP_ID;
             uint32_t divide_factor 
-                = __pmfuzz_failure_id == 0 ? 1 : __pmfuzz_failure_id;
+                = id == 0 ? 1 : id;
             
             char save_img = 0; 
             
             save_img = (prob < 10000/divide_factor) ? 1 : 0;
 
-            if (__pmfuzz_failure_id == 0) {
+            if (id == 0) {
             	save_img = 0;
             }
 
             /* If asked for, generated all the crash sites */
-            if (getenv(GEN_ALL_CS_ENV) != NULL) {
-                if ((__pmfuzz_failure_id < 100) && (__pmfuzz_failure_id%5 == 0)) {
+            if (gen_all_cs) {
+                if ((id < 100) && (id%5 == 0)) {
                     save_img = 1;
                 } else {
                     save_img = 0;
                 }
             }
 
-            if (getenv(IMG_CREAT_FINJ_ENV) != NULL) {
+            if (img_creat_finj) {
                 debug("[FI] Enabling failure image generation for all failure "
                     "points, %s=1\n", IMG_CREAT_FINJ_ENV);
                 save_img = 1;
             }
 
             if (pm_bitmap_diff && save_img) {
-                /* PM bit map updated: copy bitmap and inject failure */
-                memcpy(__last_pmfuzz_area_ptr, __pmfuzz_area_ptr, __pmfuzz_map_size);
+                /* PM bit map updated: inject failure */
+                __pmfuzz_map_dirty = 0;
+                __pmfuzz_fp_images++;
 
                 /* Enable failure point injection */
                 inject_failure = 1;
@@ -356,6 +981,7 @@ void pmfuzz_inject_failure(char* file, int line) {
             } else if (!save_img) {
                 debug("[FI] Ignoring changes\n");
             } else {
+                __pmfuzz_fp_unchanged++;
                 debug("[FI] Not injecting failure, PM image unchanged\n");
             }
             break;
@@ -365,11 +991,6 @@ void pmfuzz_inject_failure(char* file, int line) {
         }
     }
 
-    char *tc_suffix = getenv(FI_IMG_SUFFIX_ENV);
-    if (tc_suffix == NULL) {
-        tc_suffix = "";
-    }
-
     /* Create child process */
     if (inject_failure) {
         if (debug_enabled){
@@ -391,14 +1012,26 @@ void pmfuzz_inject_failure(char* file, int line) {
 
         /* Create failure image name */
         char failure_id_str[255];
-        sprintf(failure_id_str, ".%s.id=%06d.crash_site", tc_suffix, 
-            __pmfuzz_failure_id);
+        sprintf(failure_id_str, ".%s.id=%06d.crash_site", fi_img_suffix, 
+            id);
         strcat(tc_name, failure_id_str);
         
         debug("[FI] Saving image to %s\n", tc_name);
+
+        /* Pool contents live only in memory for every fake mmap mode */
+        int fake_mmap = getenv("USE_FAKE_MMAP") 
+                && atoi(getenv("USE_FAKE_MMAP")) != 0;
         
-        if (getenv("USE_FAKE_MMAP") 
-                && !strcmp(getenv("USE_FAKE_MMAP"), "1")) {
+        if (imgsnap_get_mode() != ISM_SYNC) {
+            /* Write the image without stalling for a full pool copy */
+            uint64_t pm_addr = strtoull(getenv("PM_ADDR"), NULL, 10);
+            uint64_t pm_size = strtoull(getenv("PM_SIZE"), NULL, 10);
+            if (imgsnap_take(getenv("TC_NAME"), (void*)pm_addr, pm_size, 
+                    fake_mmap, tc_name, sizeof(tc_name)) != 0) {
+                perror("Cannot snapshot PM image");
+            }
+            debug("[FI] Snapshot written to %s\n", tc_name);
+        } else if (fake_mmap) {
 
             FILE *pm_out = fopen(tc_name, "wb");
             if (pm_out) {
@@ -420,12 +1053,20 @@ void pmfuzz_inject_failure(char* file, int line) {
 
         if (mode == FIM_IMG_GEN && failure_list_file != NULL) {
             /* Print failure id to failure_list_file */
-            fprintf(failure_list_file, "%d\n", __pmfuzz_failure_id);
+            fprintf(failure_list_file, "%d\n", id);
+        }
+
+        if (mode == FIM_IMG_REP 
+                && (int32_t)id == failure_list_last) {
+            /* Nothing left to reproduce */
+            debug("[FI] Reproduced the last listed failure id\n");
+            imgsnap_wait_all();
+            exit(0);
         }
     }
 
     // Debugging
-    debug("[FI] New failure id is %d \n", __pmfuzz_failure_id);
+    debug("[FI] New failure id is %d \n", id);
 }
 
 // Read the failure list during init
@@ -479,8 +1120,8 @@ void pmfuzz_init(void* addr, unsigned long size, char* path) {
             failure_list_file = fopen(getenv(FAILURE_LIST_ENV), "r");
             /* Read failure list and update failure_list */
             int failure_id;
-            int index = 0;
 
+            assert(failure_list_file && "Failure list file not exist");
             while (1) {
                 int out = fscanf(failure_list_file, "%d", &failure_id);
                 if (out == EOF) {
@@ -489,25 +1130,132 @@ void pmfuzz_init(void* addr, unsigned long size, char* path) {
                     perror("Failure file incorret format");
                     abort();
                 }
-                /* Limit the number of failure points */
-                if (index < MAX_FAILURE_COUNT) {
-                    failure_list[index++] = failure_id;
+                /* Failure points past the limit never generate an image */
+                if (failure_id >= 0 && failure_id < MAX_FAILURE_COUNT) {
+                    failure_list[failure_id/8] |= 1 << (failure_id%8);
+                    if (failure_id > failure_list_last)
+                        failure_list_last = failure_id;
                 } else {
-                    break;
+                    debug("[FI] Ignoring failure id %d\n", failure_id);
                 }
             }
         }
         assert(failure_list_file && "Failure list file not exist");
     }
     pmfuzz_init_complete = 1;
+
+    /* Fork every execution from here, with the pool already mapped */
+    if (getenv(DEFER_FORKSRV_ENV) && __afl_manual_init) {
+        char *fake_mmap = getenv("USE_FAKE_MMAP");
+        if (fake_mmap == NULL || atoi(fake_mmap) == 0) {
+            /* Children would share and modify the same pool file */
+            dprintf(2, "[FI] " DEFER_FORKSRV_ENV " requires USE_FAKE_MMAP\n");
+            exit(1);
+        }
+        if (failure_list_file != NULL) {
+            dprintf(2, "[FI] " DEFER_FORKSRV_ENV " cannot be used with "
+                FAILURE_LIST_ENV "\n");
+            exit(1);
+        }
+        debug("[FI] Starting deferred forkserver\n");
+        __afl_manual_init();
+    }
+}
+
+/**
+ * @brief Prepares the pool for AFL's persistent mode, called by the AFL
+ * runtime before the first iteration of `__AFL_LOOP()`
+ *
+ * Requires the pool to be open, i.e., @ref pmfuzz_init() to have been
+ * called.  See pmrestore.h for what is (not) restored.
+ * @return void
+ */
+void __pmfuzz_persist_begin(void) {
+    /* The runtime cleared the map, coverage before the loop is dropped */
+    if (mt_on)
+        mt_reset();
+
+    if (!pmfuzz_init_complete) {
+        dprintf(2, "[FI] Pool not open before __AFL_LOOP(), pool will not be "
+            "restored between iterations\n");
+        return;
+    }
+
+    uint64_t pm_addr = strtoull(getenv("PM_ADDR"), NULL, 10);
+    uint64_t pm_size = strtoull(getenv("PM_SIZE"), NULL, 10);
+    if (pmrestore_snapshot((void*)pm_addr, pm_size) != 0) {
+        perror("Cannot snapshot PM pool");
+        exit(1);
+    }
+}
+
+/**
+ * @brief Resets the pool and the failure injection state between two
+ * iterations of `__AFL_LOOP()`, called by the AFL runtime
+ * @return void
+ */
+void __pmfuzz_persist_next(void) {
+    /* The fuzzer reads the map once we stop, and clears it for the next
+       iteration */
+    if (mt_on) {
+        mt_merge(1);
+        mt_reset();
+    }
+
+    if (!pmfuzz_init_complete)
+        return;
+
+    int64_t cnt = pmrestore_restore();
+    debug("[FI] Restored %ld pages of the pool\n", (long)cnt);
+
+    /* Crash images of the next input do not derive from this one's */
+    imgsnap_reset();
+    __pmfuzz_failure_id = -1;
+}
+
+/**
+ * @brief Merges the coverage of all the threads into the PM map
+ * (`PMFUZZ_MT_COVERAGE`), called at exit and by the AFL runtime when leaving
+ * `__AFL_LOOP()`. Does nothing in the other modes.
+ * @return void
+ */
+__attribute__((destructor))
+void __pmfuzz_map_flush(void) {
+    if (mt_on)
+        __pmfuzz_map_dirty |= mt_merge(1);
 }
 
 void pmfuzz_term() {
+    /* Images are consumed as soon as the target exits */
+    imgsnap_wait_all();
+
     if (getenv(FAILURE_LIST_ENV)) {
         fclose(failure_list_file);
     }
 }
 
+/**
+ * @brief Appends the failure point counts of this run to the `PMFUZZ_STATS`
+ * file, if set: failure points reached, images taken and failure points
+ * skipped because the PM map had not changed since the last image
+ * @return void
+ */
+__attribute__((destructor))
+static void pmfuzz_write_stats(void) {
+    char *path = getenv(PMFUZZ_STATS_ENV);
+    if (path == NULL || !pmfuzz_init_complete || get_fi_mode() != FIM_IMG_GEN)
+        return;
+
+    FILE *stats = fopen(path, "a");
+    if (stats == NULL) {
+        perror("Cannot open " PMFUZZ_STATS_ENV " file");
+        return;
+    }
+    fprintf(stats, "failure_points=%u images=%u skipped_unchanged=%u\n",
+        __pmfuzz_fp_reached, __pmfuzz_fp_images, __pmfuzz_fp_unchanged);
+    fclose(stats);
+}
+
 #else
 
 
@@ -533,6 +1281,11 @@ void pmfuzz_inject_failure(char* file __attribute__((unused)),
     return;
 }
 
+void pmfuzz_register_hints(volatile uint32_t *start __attribute__((unused)), 
+        volatile uint32_t *stop __attribute__((unused))) {
+    return;
+}
+
 void pmfuzz_set_addr_env(void* addr __attribute__((unused)), 
         unsigned long size __attribute__((unused))) {
     return;
@@ -546,6 +1299,17 @@ void pmfuzz_term() {
     return;
 }
 
+uint32_t __pmfuzz_failure_id = -1;
+
+void __pmfuzz_map_flush(void) {
+    return;
+}
+
+void pmfuzz_register_sites(struct pmfuzz_site *start __attribute__((unused)), 
+        struct pmfuzz_site *stop __attribute__((unused))) {
+    return;
+}
+
 void pmfuzz_init(void* addr __attribute__((unused)), 
         unsigned long size __attribute__((unused)), 
         char* path __attribute__((unused))) {
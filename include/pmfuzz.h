@@ -15,6 +15,39 @@ void pmfuzz_set_path_env(char* path);
 void pmfuzz_init(void* addr, unsigned long size, char* path);
 void pmfuzz_term(void);
 
+/**
+ * @brief Failure point site, one per PMFUZZ_FAILURE_HINT
+ *
+ * Descriptors are placed in the pmfuzz_sites section of the binary or
+ * library containing the hint, registered with libpmfuzz at startup, and
+ * enabled or disabled according to `PMFUZZ_SITES` (see libpmfuzz.c).
+ */
+struct pmfuzz_site {
+    const char          *file;
+    uint32_t            line;
+    volatile uint8_t    enabled;    /* Checked inline by the hint */
+} __attribute__((aligned(16)));
+
+void pmfuzz_register_sites(struct pmfuzz_site *start, struct pmfuzz_site *stop);
+
+/**
+ * @brief PM access hint site, one per hint the annotation pass inserts or
+ * PMFUZZ_HINT_SITE expands to
+ *
+ * Holds a stable ID picked at compile time, replaced by the map ID libpmfuzz
+ * assigns when the binary or library registers its pmfuzz_hints section at
+ * startup. Map IDs are consecutive and follow the order of the stable IDs.
+ * With ENABLE_PM_PATH, the PM map holds a counter per site and is sized to
+ * the number of sites, sites registered after the fork server started share
+ * ID 0 (see pmfuzz_register_hints() in libpmfuzz.c).
+ */
+void pmfuzz_register_hints(volatile uint32_t *start, volatile uint32_t *stop);
+
+/* ID of the last failure point reached, disabled sites count too */
+extern uint32_t     __pmfuzz_failure_id;
+
+/* Hint IDs picked at compile time, they collide in the PM map. Use
+   PMFUZZ_HINT_SITE for hints. */
 #define PMFUZZ_RND(range) \
     (((uint32_t)((15485867*__LINE__*__LINE__*(__COUNTER__+9))%4392203))%(range))
 
@@ -33,7 +66,61 @@ extern uint32_t     __pmfuzz_prev_loc;
 #define PMFUZZ_MARK_RW __attribute__((annotate("pmfuzz_pm_read_write_func")))
 #define NO_INLINE      __attribute__((noinline))
 
-#define PMFUZZ_FAILURE_HINT pmfuzz_inject_failure(__FILE__, __LINE__);
+/* Bounds of the pmfuzz_sites section, defined by the linker if the binary
+   or library has any hint */
+extern struct pmfuzz_site __start_pmfuzz_sites[]
+    __attribute__((weak, visibility("hidden")));
+extern struct pmfuzz_site __stop_pmfuzz_sites[]
+    __attribute__((weak, visibility("hidden")));
+
+/* Bounds of the pmfuzz_hints section */
+extern volatile uint32_t __start_pmfuzz_hints[]
+    __attribute__((weak, visibility("hidden")));
+extern volatile uint32_t __stop_pmfuzz_hints[]
+    __attribute__((weak, visibility("hidden")));
+
+/* Every translation unit registers the sites of its binary or library,
+   libpmfuzz ignores repeated registrations */
+__attribute__((constructor, unused))
+static void __pmfuzz_register_sites(void) {
+    struct pmfuzz_site *start = __start_pmfuzz_sites;
+    struct pmfuzz_site *stop = __stop_pmfuzz_sites;
+    volatile uint32_t *hints_start = __start_pmfuzz_hints;
+    volatile uint32_t *hints_stop = __stop_pmfuzz_hints;
+
+    if (start != stop)
+        pmfuzz_register_sites(start, stop);
+
+    if (hints_start != hints_stop)
+        pmfuzz_register_hints(hints_start, hints_stop);
+}
+
+/* Stable ID of a hint site: FNV-1a of its line, the length of its file
+   name and its position in the translation unit */
+#define PMFUZZ_HINT_STABLE_ID \
+    ((((((2166136261u ^ (uint32_t)__LINE__) * 16777619u) \
+        ^ (uint32_t)sizeof(__FILE__)) * 16777619u) \
+        ^ (uint32_t)__COUNTER__) * 16777619u)
+
+/* ID of a new hint site, for the argument of pmfuzz_ro/wo/rw(). Every
+   expansion is a distinct site. */
+#define PMFUZZ_HINT_SITE ({ \
+    static volatile uint32_t __pmfuzz_hint \
+        __attribute__((section("pmfuzz_hints"), used)) \
+        = PMFUZZ_HINT_STABLE_ID; \
+    __pmfuzz_hint; })
+
+/* Disabled sites only count the failure point, so failure IDs are the same
+   for any set of enabled sites */
+#define PMFUZZ_FAILURE_HINT do { \
+    static struct pmfuzz_site __pmfuzz_site \
+        __attribute__((section("pmfuzz_sites"), used)) \
+        = {__FILE__, __LINE__, 1}; \
+    if (__pmfuzz_site.enabled) \
+        pmfuzz_inject_failure(__FILE__, __LINE__); \
+    else \
+        __atomic_add_fetch(&__pmfuzz_failure_id, 1, __ATOMIC_RELAXED); \
+} while (0);
 
 #else
 
@@ -42,6 +129,7 @@ extern uint32_t     __pmfuzz_prev_loc;
 #define PMFUZZ_MARK_RW
 #define NO_INLINE
 
+#define PMFUZZ_HINT_SITE (__LINE__)
 #define PMFUZZ_FAILURE_HINT
 
 #endif // PMFUZZ
@@ -0,0 +1,231 @@
+/**
+ *  @file        pmfuzz_bench.c
+ *  @details     Microbenchmark for the per-hint cost of the PM coverage
+ *               runtime
+ *
+ * Measures, for each map update mode (`ENABLE_PM_PATH` set or unset), the
+ * average cost of the pmfuzz_ro()/pmfuzz_wo()/pmfuzz_rw() hints, and the
+ * cost of the shift register push of the baseline mode with the bitwise
+ * and the word-level implementation.  The map update mode is selected once
+ * per process, so every mode runs in a fresh exec of the benchmark.  The
+ * edge counter modes (`path`, and `mt` with `PMFUZZ_MT_COVERAGE`) also run
+ * pmfuzz_rw() from BENCH_THREADS threads at once.
+ *
+ * Usage: pmfuzz_bench [iterations]
+ */
+
+#define _GNU_SOURCE
+
+#include "pmfuzz.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAP_SIZE        (1 << 16)
+#define DEF_ITERATIONS  (10*1000*1000UL)
+#define MODE_ARG        "--mode"
+#define BENCH_THREADS   4
+
+/* Normally provided by the AFL runtime */
+uint32_t    __pmfuzz_map_size = MAP_SIZE;
+uint32_t    __pmfuzz_prev_loc = 0;
+uint8_t     __pmfuzz_area_initial[MAP_SIZE];
+uint8_t     *__pmfuzz_area_ptr = __pmfuzz_area_initial;
+uint8_t     __pmfuzz_map_dirty = 0;
+uint8_t     __pmfuzz_map_final = 0;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+/* Cheap location sequence with the spread of compile-time random ids */
+static inline uint32_t next_loc(uint32_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+static void bench_hint(const char *name, void (*hint)(uint32_t),
+        unsigned long iters) {
+    uint32_t state = 2463534242U;
+
+    memset(__pmfuzz_area_ptr, 0, MAP_SIZE);
+    double start = now_ns();
+    for (unsigned long i = 0; i < iters; i++)
+        hint(next_loc(&state));
+    double end = now_ns();
+
+    printf("  %-12s %8.2f ns/hint\n", name, (end - start)/iters);
+}
+
+static void *bench_thread(void *arg) {
+    unsigned long iters = *(unsigned long*)arg;
+    uint32_t state = 2463534242U + (uint32_t)(uintptr_t)&state;
+
+    for (unsigned long i = 0; i < iters; i++)
+        pmfuzz_rw(next_loc(&state));
+    return NULL;
+}
+
+/**
+ * @brief Runs pmfuzz_rw() from BENCH_THREADS threads, reports the wall time
+ * per hint of one thread
+ */
+static void bench_threads(unsigned long iters) {
+    pthread_t threads[BENCH_THREADS];
+
+    memset(__pmfuzz_area_ptr, 0, MAP_SIZE);
+    double start = now_ns();
+    for (int i = 0; i < BENCH_THREADS; i++)
+        pthread_create(&threads[i], NULL, bench_thread, &iters);
+    for (int i = 0; i < BENCH_THREADS; i++)
+        pthread_join(threads[i], NULL);
+    double end = now_ns();
+
+    printf("  %-12s %8.2f ns/hint (%d threads)\n", "pmfuzz_rw", 
+        (end - start)/iters, BENCH_THREADS);
+}
+
+static void bench_sra(const char *name,
+        void (*push)(uint8_t*, size_t, size_t, size_t, uint8_t),
+        unsigned long iters) {
+    const size_t elem_sz = 32;
+    uint32_t state = 2463534242U;
+
+    memset(__pmfuzz_area_ptr, 0, MAP_SIZE);
+    double start = now_ns();
+    for (unsigned long i = 0; i < iters; i++)
+        push(__pmfuzz_area_ptr, MAP_SIZE, elem_sz,
+            next_loc(&state)%(MAP_SIZE/elem_sz), 0);
+    double end = now_ns();
+
+    printf("  %-12s %8.2f ns/push\n", name, (end - start)/iters);
+}
+
+static void push_bitwise(uint8_t *mem, size_t size, size_t elem_sz,
+        size_t loc, uint8_t basebit) {
+    sra_push_back_bitwise(mem, size, elem_sz, loc, basebit);
+}
+
+static void push_word(uint8_t *mem, size_t size, size_t elem_sz,
+        size_t loc, uint8_t basebit) {
+    sra_push_back(mem, size, elem_sz, loc, basebit);
+}
+
+/**
+ * @brief Checks that both shift register implementations agree
+ * @return 0 if they do, -1 otherwise
+ */
+static int check_sra(void) {
+    static uint8_t ref[MAP_SIZE], out[MAP_SIZE];
+    const size_t sizes[] = {1, 2, 8, 32};
+
+    for (size_t s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s++) {
+        for (int basebit = 0; basebit <= SRA_UNSET; basebit += SRA_UNSET) {
+            uint32_t state = 88172645U;
+            memset(ref, basebit, sizeof(ref));
+            memset(out, basebit, sizeof(out));
+
+            for (int i = 0; i < 200000; i++) {
+                size_t loc = next_loc(&state)%(4096/sizes[s]);
+                sra_push_back_bitwise(ref, 4096, sizes[s], loc, basebit);
+                sra_push_back(out, 4096, sizes[s], loc, basebit);
+            }
+
+            if (memcmp(ref, out, sizeof(ref)) != 0) {
+                fprintf(stderr, "sra_push_back() mismatch: elem_sz = %zu, "
+                    "basebit = %d\n", sizes[s], basebit);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static void bench_mode(const char *mode, unsigned long iters) {
+    printf("%s:\n", mode);
+    bench_hint("pmfuzz_ro", pmfuzz_ro, iters);
+    bench_hint("pmfuzz_wo", pmfuzz_wo, iters);
+    bench_hint("pmfuzz_rw", pmfuzz_rw, iters);
+    if (strcmp(mode, "baseline") != 0)
+        bench_threads(iters);
+}
+
+/**
+ * @brief Runs one map update mode in a new exec of the benchmark
+ */
+static int run_mode(char *self, const char *mode, const char *iters_str) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+
+    if (pid == 0) {
+        if (strcmp(mode, "baseline") != 0) {
+            setenv("ENABLE_PM_PATH", "1", 1);
+        } else {
+            unsetenv("ENABLE_PM_PATH");
+        }
+        if (strcmp(mode, "mt") == 0) {
+            setenv("PMFUZZ_MT_COVERAGE", "1", 1);
+        } else {
+            unsetenv("PMFUZZ_MT_COVERAGE");
+        }
+        char *argv[] = {self, (char*)iters_str, MODE_ARG, (char*)mode, NULL};
+        execv("/proc/self/exe", argv);
+        perror("execv");
+        _exit(1);
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) < 0)
+        return -1;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned long iters = DEF_ITERATIONS;
+    if (argc > 1)
+        iters = strtoul(argv[1], NULL, 10);
+
+    /* Child: the map update mode was selected before main() */
+    if (argc == 4 && strcmp(argv[2], MODE_ARG) == 0) {
+        bench_mode(argv[3], iters);
+        return 0;
+    }
+
+    char iters_str[32];
+    snprintf(iters_str, sizeof(iters_str), "%lu", iters);
+
+    if (check_sra() != 0)
+        return 1;
+
+    printf("shift register (elem_sz = 32):\n");
+    bench_sra("bitwise", push_bitwise, iters);
+    bench_sra("word", push_word, iters);
+
+    /* Cost every hint paid for reading the mode before it was cached */
+    volatile char *env = NULL;
+    double start = now_ns();
+    for (unsigned long i = 0; i < iters; i++)
+        env = getenv("ENABLE_PM_PATH");
+    (void)env;
+    printf("getenv():\n  %-12s %8.2f ns/call\n", "ENABLE_PM_PATH",
+        (now_ns() - start)/iters);
+
+    fflush(stdout);
+    if (run_mode(argv[0], "path", iters_str) != 0
+            || run_mode(argv[0], "mt", iters_str) != 0
+            || run_mode(argv[0], "baseline", iters_str) != 0)
+        return 1;
+    return 0;
+}
@@ -3,4 +3,12 @@
 
 #include "../VERSION"
 
-#endif // INCLUDE_PMFUZZ_CONFIG_HEADER__
\ No newline at end of file
+/* Size of the PM map, must match MAP_SIZE_POW2 in AFL's config.h */
+#define PMFUZZ_MAP_SIZE_POW2    18
+#define PMFUZZ_MAP_SIZE         (1 << PMFUZZ_MAP_SIZE_POW2)
+
+/* Smallest PM map sized from the hint sites, a multiple of two MAP_BLOCKs
+   of AFL's afl-pmfuzz-maps.h */
+#define PMFUZZ_MAP_SIZE_MIN     64
+
+#endif // INCLUDE_PMFUZZ_CONFIG_HEADER__
@@ -0,0 +1,99 @@
+/**
+ *  @file        pmrestore.c
+ *  @details     Pristine pool snapshot and page-level restore, see
+ *               pmrestore.h
+ */
+
+#define _GNU_SOURCE
+
+#include "pmrestore.h"
+#include "imgsnap.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Pool being restored and its pristine copy */
+static char    *pool_addr       = NULL;
+static size_t   pool_size       = 0;
+static char    *pristine        = NULL;
+static uint32_t page_size       = 0;
+static int      use_soft_dirty  = 0;
+
+static void restore_page(uint64_t idx) {
+    size_t off = idx*page_size;
+    size_t len = pool_size - off < page_size ? pool_size - off : page_size;
+    memcpy(pool_addr + off, pristine + off, len);
+}
+
+/**
+ * @brief Copies the pool to the pristine buffer restored by
+ * @ref pmrestore_restore()
+ * @param addr Starting address of the pool mapping
+ * @param size Size of the pool mapping
+ * @return 0 on success, -1 on failure
+ */
+int pmrestore_snapshot(void *addr, size_t size) {
+    if (pristine != NULL)
+        munmap(pristine, pool_size);
+
+    pristine = mmap(NULL, size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pristine == MAP_FAILED) {
+        pristine = NULL;
+        return -1;
+    }
+
+    pool_addr = addr;
+    pool_size = size;
+    page_size = sysconf(_SC_PAGESIZE);
+    memcpy(pristine, pool_addr, pool_size);
+
+    /* imgsnap's DELTA mode clears the soft-dirty bits at every image */
+    use_soft_dirty = imgsnap_get_mode() != ISM_DELTA
+        && imgsnap_soft_dirty_ok()
+        && imgsnap_clear_soft_dirty() == 0;
+    return 0;
+}
+
+/**
+ * @brief Restores the pages of the pool modified since the snapshot or the
+ * last restore
+ * @return Number of pages restored, -1 on failure
+ */
+int64_t pmrestore_restore(void) {
+    uint64_t page_total = (pool_size + page_size - 1)/page_size;
+    int64_t cnt = 0;
+
+    if (pristine == NULL)
+        return -1;
+
+    if (use_soft_dirty) {
+        uint64_t *pages = NULL;
+        cnt = imgsnap_dirty_pages(pool_addr, pool_size, page_size, &pages);
+        if (cnt >= 0) {
+            for (int64_t i = 0; i < cnt; i++)
+                restore_page(pages[i]);
+            free(pages);
+
+            if (imgsnap_clear_soft_dirty() == 0)
+                return cnt;
+        }
+        /* Tracking broke down, compare every page from now on */
+        dprintf(2, "[FI] Soft-dirty tracking failed, comparing pages\n");
+        use_soft_dirty = 0;
+        cnt = 0;
+    }
+
+    for (uint64_t idx = 0; idx < page_total; idx++) {
+        size_t off = idx*page_size;
+        size_t len = pool_size - off < page_size ? pool_size - off : page_size;
+        if (memcmp(pool_addr + off, pristine + off, len) != 0) {
+            restore_page(idx);
+            cnt++;
+        }
+    }
+    return cnt;
+}
@@ -0,0 +1,23 @@
+/**
+ *  @file        pmrestore.h
+ *  @details     Pristine pool snapshot and page-level restore for AFL's
+ *               persistent mode
+ *
+ * In persistent mode the target keeps the pool open and processes many
+ * inputs in a single process.  Before the first iteration pmrestore copies
+ * the pool to a pristine buffer; after every iteration it copies back only
+ * the pages the iteration dirtied.  Dirty pages are found using the kernel's
+ * soft-dirty bits, or by comparing every page against the pristine copy if
+ * soft-dirty tracking is unavailable or in use by imgsnap's `DELTA` mode.
+ *
+ * Only the pool is restored.  Volatile state of the target and of PMDK
+ * (e.g., allocator caches and lane state) is carried across iterations.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+int pmrestore_snapshot(void *addr, size_t size);
+int64_t pmrestore_restore(void);
@@ -12,6 +12,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #define SRA_SET   0
 #define SRA_UNSET 255
@@ -35,18 +36,19 @@
   (byte & 0x01 ? '1' : '0') 
 
 /**
- * @brief Pushes back either 1 or 0 to the end of the shift register 
+ * @brief Pushes back either 1 or 0 to the end of the shift register, one
+ * bit at a time; reference implementation of @ref sra_push_back()
  * @param mem Pointer to the shift reg array
  * @param size Size of the shift reg array in bytes
  * @param elem_sz Size of each element in bytes (used for indexing the array)
  * @param loc Index of the shift reg in the array
  * @param basebit Value of unset bit in the map
- * @return void
+ * @return 1 if the register changed, 0 if it was already full
  * 
  * **NOTE**: elem_sz cannot be larger than INT_32_MAX
 */
-static inline void 
-sra_push_back(uint8_t *mem, size_t size, size_t elem_sz, size_t loc, uint8_t basebit) {
+static inline uint8_t 
+sra_push_back_bitwise(uint8_t *mem, size_t size, size_t elem_sz, size_t loc, uint8_t basebit) {
     size_t elem_cnt = size/elem_sz;
     assert(loc < elem_cnt);
 
@@ -77,5 +79,63 @@ sra_push_back(uint8_t *mem, size_t size, size_t elem_sz, size_t loc, uint8_t bas
                 BITCLEAR(arr, it);
             }
         }
+        return 1;
+    }
+    return 0;
+}
+/**
+ * @brief Pushes back either 1 or 0 to the end of the shift register
+ * 
+ * Same as @ref sra_push_back_bitwise(), but finds the most significant set
+ * bit one 64-bit word at a time using clz: the highest set bit moves up by
+ * one (saturating at the top), or bit 0 is set if the register is empty.
+ * Falls back to the bitwise version if elem_sz is not a multiple of 8 bytes.
+ * @param mem Pointer to the shift reg array
+ * @param size Size of the shift reg array in bytes
+ * @param elem_sz Size of each element in bytes (used for indexing the array)
+ * @param loc Index of the shift reg in the array
+ * @param basebit Value of unset bit in the map
+ * @return 1 if the register changed, 0 if it was already full
+*/
+static inline uint8_t 
+sra_push_back(uint8_t *mem, size_t size, size_t elem_sz, size_t loc, uint8_t basebit) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if (elem_sz % sizeof(uint64_t) == 0) {
+        assert(loc < size/elem_sz);
+
+        uint8_t *arr = mem+(loc*elem_sz);
+        uint64_t flip = basebit ? ~0ULL : 0;
+        size_t top = elem_sz*8 - 1;
+
+        for (size_t w = elem_sz/sizeof(uint64_t); w-- > 0; ) {
+            uint64_t word;
+            memcpy(&word, arr + w*sizeof(uint64_t), sizeof(word));
+            word ^= flip;
+            if (word == 0)
+                continue;
+
+            size_t it = w*64 + 63 - __builtin_clzll(word);
+            if (it == top)
+                return 0;
+
+            if (basebit) {
+                BITCLEAR(arr, it+1);
+                BITSET(arr, it);
+            } else {
+                BITSET(arr, it+1);
+                BITCLEAR(arr, it);
+            }
+            return 1;
+        }
+
+        /* Empty register */
+        if (basebit) {
+            BITCLEAR(arr, 0);
+        } else {
+            BITSET(arr, 0);
+        }
+        return 1;
     }
-}
\ No newline at end of file
+#endif
+    return sra_push_back_bitwise(mem, size, elem_sz, loc, basebit);
+}
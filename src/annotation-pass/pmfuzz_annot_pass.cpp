@@ -1,9 +1,11 @@
+#include <cstdlib>
 #include <iostream>
 #include <string>
 #include <vector>
 
 #include "pmfuzz_config.h"
 #include "llvm/Pass.h"
+#include "llvm/Support/ErrorHandling.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Function.h"
@@ -16,6 +18,7 @@
 #include "llvm/IR/LegacyPassManager.h"
 // #include "llvm/IR/TypeBuilder.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 
 
 // TODO: hint and function names can merge with a common header
@@ -29,6 +32,19 @@
 #define PMWriteHint "pmfuzz_wo"
 #define PMReadWriteHint "pmfuzz_rw"
 
+// Map variables of the AFL runtime, updated by inlined hints
+#define PMAreaPtr "__pmfuzz_area_ptr"
+#define PMMapDirty "__pmfuzz_map_dirty"
+#define PMMapSize "__pmfuzz_map_size"
+
+// Hint sites, see PMFUZZ_HINT_SITE in pmfuzz.h
+#define HintSection "pmfuzz_hints"
+#define HintSiteVar "__pmfuzz_hint"
+#define HintRegisterFunc "pmfuzz_register_hints"
+
+// Set to inline the map update of hints instead of calling the hints
+#define InlineHintsEnv "PMFUZZ_INLINE_HINTS"
+
 using namespace llvm;
 
 namespace {
@@ -43,14 +59,33 @@ struct AnnotPass : public ModulePass {
   // Check if function has PM write attribute
   bool isPMWriteFunc(Function* fn);
 
+  // Inline hints instead of calling pmfuzz_ro/wo/rw
+  bool InlineHints = false;
+  Constant *AreaPtr = nullptr, *MapDirty = nullptr, *MapSizeVar = nullptr;
+
+  // Compute the stable ID of a hint, libpmfuzz orders the sites by it
+  uint32_t getHintID(Module &M, BasicBlock &BB, uint32_t BBIdx);
+
+  // Create the hint site of a BB, its map ID is assigned by libpmfuzz
+  GlobalVariable* createHintSite(Module &M, uint32_t HintID);
+
+  // Register the hint sites of the binary or library from a constructor
+  void insertHintRegistration(Module &M);
+
   // Create and insert hint functions
-  CallInst* insertPMReadWriteHint(Module &M, BasicBlock &BB, std::string FuncName);
+  CallInst* insertPMReadWriteHint(Module &M, BasicBlock &BB, std::string FuncName,
+                                  GlobalVariable *Site);
+
+  // Insert the map update of a hint at the beginning of the BB
+  void insertInlineUpdate(Module &M, IRBuilder<> &IRB, Value *Loc);
+  void insertInlineHint(Module &M, BasicBlock &BB, bool Read, bool Write,
+                        GlobalVariable *Site);
 
   // Assign attributes to each function in the module
   uint32_t annotAllFuncs(Module &M);
 
   // Label each BB with PM R/W functions for AFL
-  uint32_t labelPMBasicBlock(Module &M, BasicBlock &BB);
+  uint32_t labelPMBasicBlock(Module &M, BasicBlock &BB, uint32_t BBIdx);
 
   bool runOnModule(Module &M) override;
 }; // end of AnnotPass
@@ -68,8 +103,131 @@ bool AnnotPass::isPMWriteFunc(Function* fn)
 }
 }  // end of anonymous namespace
 
+uint32_t AnnotPass::getHintID(Module &M, BasicBlock &BB, uint32_t BBIdx)
+{
+  Function *F = BB.getParent();
+  std::string Key;
+
+  // Local functions of different modules may share a name
+  if (F->hasLocalLinkage()) {
+    Key += M.getSourceFileName();
+    Key += '\0';
+  }
+  Key += F->getName().str();
+
+  // FNV-1a, stable across builds unlike rand()
+  uint32_t Hash = 2166136261u;
+  for (unsigned char C : Key) {
+    Hash = (Hash ^ C) * 16777619u;
+  }
+  for (int i = 0; i < 4; i++) {
+    Hash = (Hash ^ ((BBIdx >> (8*i)) & 0xff)) * 16777619u;
+  }
+  return Hash;
+}
+
+GlobalVariable* AnnotPass::createHintSite(Module &M, uint32_t HintID)
+{
+  IntegerType *Int32Ty = Type::getInt32Ty(M.getContext());
+  GlobalVariable *Site = new GlobalVariable(M, Int32Ty, false,
+                                            GlobalValue::PrivateLinkage,
+                                            ConstantInt::get(Int32Ty, HintID),
+                                            HintSiteVar);
+  Site->setSection(HintSection);
+  Site->setAlignment(MaybeAlign(4));
+  appendToCompilerUsed(M, {Site});
+  return Site;
+}
+
+void AnnotPass::insertHintRegistration(Module &M)
+{
+  LLVMContext &ctx = M.getContext();
+  IntegerType *Int32Ty = Type::getInt32Ty(ctx);
+  Type *Int32PtrTy = PointerType::get(Int32Ty, 0);
+
+  // Linker-defined bounds of the section, hidden to get the ones of the
+  // binary or library being linked. pmfuzz.h may have declared them.
+  Constant *Bounds[2];
+  const char *BoundNames[2] = {"__start_" HintSection, "__stop_" HintSection};
+  for (int i = 0; i < 2; i++) {
+    GlobalVariable *Bound = M.getNamedGlobal(BoundNames[i]);
+    if (!Bound) {
+      Bound = new GlobalVariable(M, Int32Ty, false,
+                                 GlobalValue::ExternalWeakLinkage, nullptr,
+                                 BoundNames[i]);
+      Bound->setVisibility(GlobalValue::HiddenVisibility);
+    }
+    Bounds[i] = ConstantExpr::getPointerCast(Bound, Int32PtrTy);
+  }
+
+  FunctionCallee Register = M.getOrInsertFunction(HintRegisterFunc,
+      Type::getVoidTy(ctx), Int32PtrTy, Int32PtrTy);
+
+  // Same as the constructor of pmfuzz.h, libpmfuzz ignores repeats
+  Function *Ctor = Function::Create(
+      FunctionType::get(Type::getVoidTy(ctx), false),
+      GlobalValue::InternalLinkage, "__pmfuzz_register_hints_ctor", &M);
+  IRBuilder<> IRB(BasicBlock::Create(ctx, "", Ctor));
+  IRB.CreateCall(Register, {Bounds[0], Bounds[1]});
+  IRB.CreateRetVoid();
+  appendToGlobalCtors(M, Ctor, 65535);
+}
+
+void AnnotPass::insertInlineUpdate(Module &M, IRBuilder<> &IRB, Value *Loc)
+{
+  LLVMContext &ctx = M.getContext();
+  IntegerType *Int8Ty = IRB.getInt8Ty();
+  MDNode *NoSan = MDNode::get(ctx, None);
+  unsigned NoSanKind = M.getMDKindID("nosanitize");
+
+  // Saturating increment of __pmfuzz_area_ptr[loc]
+  LoadInst *Area = IRB.CreateLoad(PointerType::get(Int8Ty, 0), AreaPtr);
+  Area->setMetadata(NoSanKind, NoSan);
+  Value *Slot = IRB.CreateGEP(Int8Ty, Area,
+                              IRB.CreateZExt(Loc, IRB.getInt64Ty()));
+  LoadInst *Counter = IRB.CreateLoad(Int8Ty, Slot);
+  Counter->setMetadata(NoSanKind, NoSan);
+  Value *NotSat = IRB.CreateZExt(
+      IRB.CreateICmpNE(Counter, ConstantInt::get(Int8Ty, 255)), Int8Ty);
+  IRB.CreateStore(IRB.CreateAdd(Counter, NotSat), Slot)
+      ->setMetadata(NoSanKind, NoSan);
+
+  // __pmfuzz_map_dirty |= not_saturated, for failure point deduplication
+  LoadInst *Dirty = IRB.CreateLoad(Int8Ty, MapDirty);
+  Dirty->setMetadata(NoSanKind, NoSan);
+  IRB.CreateStore(IRB.CreateOr(Dirty, NotSat), MapDirty)
+      ->setMetadata(NoSanKind, NoSan);
+}
+
+void AnnotPass::insertInlineHint(Module &M, BasicBlock &BB, bool Read,
+                                 bool Write, GlobalVariable *Site)
+{
+  IRBuilder<> IRB(&*BB.getFirstInsertionPt());
+  IntegerType *Int32Ty = IRB.getInt32Ty();
+  MDNode *NoSan = MDNode::get(M.getContext(), None);
+  unsigned NoSanKind = M.getMDKindID("nosanitize");
+
+  // Registered IDs are within the read half of the map, mask the stable
+  // ID of a site read before its registration as pmfuzz_ro/wo/rw do
+  LoadInst *Size = IRB.CreateLoad(Int32Ty, MapSizeVar);
+  Size->setMetadata(NoSanKind, NoSan);
+  Value *Half = IRB.CreateLShr(Size, 1);
+  Value *HintID = IRB.CreateAnd(
+      IRB.CreateLoad(Int32Ty, Site, /*isVolatile=*/true),
+      IRB.CreateSub(Half, ConstantInt::get(Int32Ty, 1)));
+
+  // Same map locations as pmfuzz_ro/wo/rw, writes go to the upper half
+  if (Read) {
+    insertInlineUpdate(M, IRB, HintID);
+  }
+  if (Write) {
+    insertInlineUpdate(M, IRB, IRB.CreateAdd(HintID, Half));
+  }
+}
+
 CallInst* AnnotPass::insertPMReadWriteHint(Module &M, 
-                        BasicBlock &BB, std::string FuncName)
+                        BasicBlock &BB, std::string FuncName,
+                        GlobalVariable *Site)
 {
     // Get context
     LLVMContext &ctx = M.getContext();
@@ -78,16 +236,16 @@ CallInst* AnnotPass::insertPMReadWriteHint(Module &M,
                                   FunctionType::getVoidTy(ctx), 
                                   Type::getInt32Ty(ctx)).getCallee());
     assert(insertFunc);
-    // Create arguments
+    // Create arguments, the ID of the hint site
+    Instruction *InsertPt = &*BB.getFirstInsertionPt();
     std::vector<Value *> arglist;
-    int val = rand();
-    Value *arg0 = ConstantInt::get(IntegerType::get(M.getContext(), 32), val);
+    Value *arg0 = new LoadInst(Type::getInt32Ty(ctx), Site, "", 
+                               /*isVolatile=*/true, InsertPt);
     arglist.push_back(arg0);
 
     // Insert to the beginning of the BB
     CallInst *insertCallInstr = CallInst::Create(insertFunc, 
-                            ArrayRef<Value *>(arglist), "", 
-                            cast<Instruction>(BB.getFirstInsertionPt()));
+                            ArrayRef<Value *>(arglist), "", InsertPt);
     assert(insertCallInstr);
     return insertCallInstr;
 }
@@ -117,7 +275,8 @@ uint32_t AnnotPass::annotAllFuncs(Module &M)
   return annotCount;
 }
 
-uint32_t AnnotPass::labelPMBasicBlock(Module &M, BasicBlock &BB) 
+uint32_t AnnotPass::labelPMBasicBlock(Module &M, BasicBlock &BB, 
+                                      uint32_t BBIdx) 
 {
   uint32_t BBhasPMReadFunc = 0, BBhasPMWriteFunc = 0;
   // Check if any function call has PM read/write attribute
@@ -162,13 +321,19 @@ uint32_t AnnotPass::labelPMBasicBlock(Module &M, BasicBlock &BB)
       BBhasPMWriteFunc += isPMWriteFunc(CalledFunc);
     }
   }
-  // Inject AFL hints
-  if (BBhasPMReadFunc && BBhasPMWriteFunc) { // PM read + write hint
-    insertPMReadWriteHint(M, BB, PMReadWriteHint);
+  // Inject AFL hints, a single hint covers all PM calls of the BB
+  if (!BBhasPMReadFunc && !BBhasPMWriteFunc) {
+    return 0;
+  }
+  GlobalVariable *Site = createHintSite(M, getHintID(M, BB, BBIdx));
+  if (InlineHints) {
+    insertInlineHint(M, BB, BBhasPMReadFunc, BBhasPMWriteFunc, Site);
+  } else if (BBhasPMReadFunc && BBhasPMWriteFunc) { // PM read + write hint
+    insertPMReadWriteHint(M, BB, PMReadWriteHint, Site);
   } else if (BBhasPMReadFunc) { // PM read hint
-    insertPMReadWriteHint(M, BB, PMReadHint);
+    insertPMReadWriteHint(M, BB, PMReadHint, Site);
   } else if (BBhasPMWriteFunc) { // PM write hint
-    insertPMReadWriteHint(M, BB, PMWriteHint);
+    insertPMReadWriteHint(M, BB, PMWriteHint, Site);
   }
   // Return true if hints are inserted
   return BBhasPMReadFunc + BBhasPMWriteFunc;
@@ -176,9 +341,17 @@ uint32_t AnnotPass::labelPMBasicBlock(Module &M, BasicBlock &BB)
 
 bool AnnotPass::runOnModule(Module &M) 
 {
-  srand(0);
   uint32_t modifyCount = 0;
 
+  InlineHints = getenv(InlineHintsEnv) != nullptr;
+  if (InlineHints) {
+    LLVMContext &ctx = M.getContext();
+    AreaPtr = M.getOrInsertGlobal(PMAreaPtr,
+                                  PointerType::get(Type::getInt8Ty(ctx), 0));
+    MapDirty = M.getOrInsertGlobal(PMMapDirty, Type::getInt8Ty(ctx));
+    MapSizeVar = M.getOrInsertGlobal(PMMapSize, Type::getInt32Ty(ctx));
+  }
+
   errs() << "+++ \x1b[0;36m" << PMFUZZ_NAME << "\x1b[0m" 
             << "\x1b[1;97m" << " Annotation Pass" << "\x1b[0m" 
             << " v" << PMFUZZ_VERSION << " by " 
@@ -196,16 +369,21 @@ bool AnnotPass::runOnModule(Module &M)
     readFuns += isPMReadFunc(&F);
     writeFuns += isPMWriteFunc(&F);
     // errs() << F.getName() << "\n";
+    uint32_t BBIdx = 0;
     for (auto &BB : F) {
-      modifyCount += labelPMBasicBlock(M, BB);
+      modifyCount += labelPMBasicBlock(M, BB, BBIdx++);
     }
   }
+  if (modifyCount) {
+    insertHintRegistration(M);
+  }
 
   errs() << "Found " << "\x1b[1;97m" << readFuns << "\x1b[0m" 
          << " read annotation(s) and " << "\x1b[1;97m" << writeFuns << "\x1b[0m" 
          << " write annotation(s)." << " Modified? " 
          << (modifyCount ? "\x1b[1;92mYes" : "\x1b[1;93mNo") << "\x1b[0m" 
-         << " (" << modifyCount << " BB)" << "\n";
+         << " (" << modifyCount << " BB)" 
+         << (InlineHints ? ", hints inlined" : "") << "\n";
   
   return (bool)modifyCount; // Return true if this pass has modified IR
 }
@@ -0,0 +1,851 @@
+/**
+ *  @file        imgstore.c
+ *  @details     Content-addressed store for PM images, see imgstore.h
+ */
+
+#define _GNU_SOURCE
+
+#include "imgstore.h"
+#include "imgsnap.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
+
+/* Maximum length of a chain of parents, guards against corrupted stores */
+#define MAX_CHAIN_LEN   (4096)
+/* Number of pages written per writev() */
+#define WRITE_BATCH     (64)
+
+#define HASH_K1         (0x9e3779b97f4a7c15ULL)
+#define HASH_K2         (0xc2b2ae3d27d4eb4fULL)
+
+struct imgstore {
+    char root[PATH_MAX/2]; /* Leaves room for the paths inside the store */
+};
+
+/* An object mapped in memory */
+typedef struct {
+    uint8_t                *map;
+    size_t                  len;
+    imgstore_obj_hdr_t     *hdr;
+    uint64_t               *hashes;
+    uint64_t               *idx;
+    uint8_t                *data;
+} obj_t;
+
+/* An object found by imgstore_gc() */
+typedef struct {
+    uint8_t                 id[IMGSTORE_ID_LEN];
+    uint8_t                 parent[IMGSTORE_ID_LEN];
+    int                     live;
+} gc_obj_t;
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/**
+ * @brief Hashes a buffer using four independent lanes so the multiplies of
+ * consecutive words do not depend on each other
+ */
+static uint64_t hash_buf(const void *buf, size_t len, uint64_t seed) {
+    const uint8_t *ptr = buf;
+    uint64_t h[4] = {seed, seed ^ HASH_K1, seed ^ HASH_K2, seed + HASH_K1};
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        for (int lane = 0; lane < 4; lane++) {
+            uint64_t v;
+            memcpy(&v, ptr + i + 8*lane, sizeof(v));
+            h[lane] = rotl64(h[lane] ^ (v*HASH_K1), 31)*HASH_K2;
+        }
+    }
+
+    uint64_t result = h[0] ^ rotl64(h[1], 17) ^ rotl64(h[2], 29)
+        ^ rotl64(h[3], 43) ^ len;
+    for (; i < len; i++) {
+        result = (result ^ ptr[i])*HASH_K1;
+    }
+
+    return fmix64(result);
+}
+
+static void id_to_str(const uint8_t id[IMGSTORE_ID_LEN],
+        char str[IMGSTORE_ID_STR_LEN]) {
+    for (int i = 0; i < IMGSTORE_ID_LEN; i++) {
+        sprintf(str + 2*i, "%02x", id[i]);
+    }
+}
+
+static int str_to_id(const char *str, uint8_t id[IMGSTORE_ID_LEN]) {
+    for (int i = 0; i < IMGSTORE_ID_LEN; i++) {
+        unsigned int byte;
+        if (sscanf(str + 2*i, "%2x", &byte) != 1)
+            return -1;
+        id[i] = byte;
+    }
+    return 0;
+}
+
+static int id_is_zero(const uint8_t id[IMGSTORE_ID_LEN]) {
+    for (int i = 0; i < IMGSTORE_ID_LEN; i++) {
+        if (id[i])
+            return 0;
+    }
+    return 1;
+}
+
+static void obj_path(const imgstore_t *store, const char *id_str,
+        char *buf, size_t len) {
+    snprintf(buf, len, "%s/objects/%.2s/%s", store->root, id_str, id_str + 2);
+}
+
+static void ref_path(const imgstore_t *store, const char *name,
+        char *buf, size_t len) {
+    snprintf(buf, len, "%s/refs/%016llx", store->root,
+        (unsigned long long)hash_buf(name, strlen(name), 0));
+}
+
+static void tmp_path(const imgstore_t *store, const char *what,
+        char *buf, size_t len) {
+    static unsigned int counter = 0;
+    snprintf(buf, len, "%s/tmp/%s.%d.%u", store->root, what, getpid(),
+        counter++);
+}
+
+static int make_dir(const char *path) {
+    if (mkdir(path, 0755) != 0 && errno != EEXIST)
+        return -1;
+    return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *ptr = buf;
+    while (len > 0) {
+        ssize_t ret = write(fd, ptr, len);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        ptr += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+/**
+ * @brief Opens an image store, creating it if it does not exist
+ * @param root Directory of the store
+ * @return Handle to the store, NULL on failure
+ */
+imgstore_t *imgstore_open(const char *root) {
+    char path[PATH_MAX];
+    imgstore_t *store = calloc(1, sizeof(*store));
+    if (store == NULL)
+        return NULL;
+
+    if (strlen(root) >= sizeof(store->root)) {
+        free(store);
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    snprintf(store->root, sizeof(store->root), "%s", root);
+
+    const char *dirs[] = {"", "/objects", "/refs", "/tmp"};
+    for (size_t i = 0; i < sizeof(dirs)/sizeof(dirs[0]); i++) {
+        snprintf(path, sizeof(path), "%s%s", root, dirs[i]);
+        if (make_dir(path) != 0) {
+            free(store);
+            return NULL;
+        }
+    }
+
+    return store;
+}
+
+void imgstore_close(imgstore_t *store) {
+    free(store);
+}
+
+/**
+ * @brief Looks up the object id of an image
+ * @param store Store to look into
+ * @param name Name the image was stored with
+ * @param id_str Set to the object id of the image
+ * @return 0 on success, -1 if the image is not in the store
+ */
+int imgstore_resolve(imgstore_t *store, const char *name,
+        char id_str[IMGSTORE_ID_STR_LEN]) {
+    char path[PATH_MAX];
+    char *line = NULL;
+    size_t line_len = 0;
+    int result = -1;
+
+    ref_path(store, name, path, sizeof(path));
+    FILE *ref = fopen(path, "r");
+    if (ref == NULL)
+        return -1;
+
+    ssize_t len = getline(&line, &line_len, ref);
+    if (len > IMGSTORE_ID_STR_LEN && line[IMGSTORE_ID_STR_LEN - 1] == ' ') {
+        if (line[len - 1] == '\n')
+            line[len - 1] = '\0';
+
+        /* Refs are named by a hash of the name, check for a collision */
+        if (strcmp(line + IMGSTORE_ID_STR_LEN, name) == 0) {
+            memcpy(id_str, line, IMGSTORE_ID_STR_LEN - 1);
+            id_str[IMGSTORE_ID_STR_LEN - 1] = '\0';
+            result = 0;
+        }
+    }
+
+    free(line);
+    fclose(ref);
+    if (result != 0)
+        errno = ENOENT;
+    return result;
+}
+
+int imgstore_has(imgstore_t *store, const char *name) {
+    char id_str[IMGSTORE_ID_STR_LEN];
+    return imgstore_resolve(store, name, id_str) == 0;
+}
+
+/**
+ * @brief Removes the reference to an image, objects are kept as other
+ * images may share them or use them as a parent, see imgstore_gc()
+ */
+int imgstore_remove(imgstore_t *store, const char *name) {
+    char path[PATH_MAX];
+
+    if (!imgstore_has(store, name))
+        return -1;
+
+    ref_path(store, name, path, sizeof(path));
+    return unlink(path);
+}
+
+static void obj_unmap(obj_t *obj) {
+    if (obj->map != NULL)
+        munmap(obj->map, obj->len);
+    obj->map = NULL;
+}
+
+static int obj_map(imgstore_t *store, const char *id_str, obj_t *obj) {
+    char path[PATH_MAX];
+    struct stat st;
+
+    obj_path(store, id_str, path, sizeof(path));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(imgstore_obj_hdr_t)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    obj->len = st.st_size;
+    obj->map = mmap(NULL, obj->len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (obj->map == MAP_FAILED) {
+        obj->map = NULL;
+        return -1;
+    }
+
+    obj->hdr = (imgstore_obj_hdr_t*)obj->map;
+    uint64_t page_total =
+        (obj->hdr->img_size + obj->hdr->page_size - 1)/obj->hdr->page_size;
+    size_t expected = sizeof(imgstore_obj_hdr_t)
+        + (page_total + obj->hdr->page_cnt)*sizeof(uint64_t)
+        + obj->hdr->page_cnt*obj->hdr->page_size;
+
+    if (memcmp(obj->hdr->magic, IMGSTORE_OBJ_MAGIC, sizeof(obj->hdr->magic))
+            || obj->hdr->page_size != IMGSTORE_PAGE_SIZE
+            || obj->len != expected) {
+        obj_unmap(obj);
+        errno = EINVAL;
+        return -1;
+    }
+
+    obj->hashes = (uint64_t*)(obj->map + sizeof(imgstore_obj_hdr_t));
+    obj->idx    = obj->hashes + page_total;
+    obj->data   = (uint8_t*)(obj->idx + obj->hdr->page_cnt);
+    return 0;
+}
+
+/**
+ * @brief Maps an object and all its parents, youngest first
+ * @param chain Array of MAX_CHAIN_LEN objects, unmapped by chain_unmap()
+ * @param chain_len Set to the number of objects mapped, also on failure
+ * @return 0 on success, -1 on failure
+ */
+static int chain_map(imgstore_t *store, const char *id_str, obj_t *chain,
+        size_t *chain_len) {
+    char cur[IMGSTORE_ID_STR_LEN];
+
+    snprintf(cur, sizeof(cur), "%s", id_str);
+    *chain_len = 0;
+    while (*chain_len < MAX_CHAIN_LEN) {
+        obj_t *obj = &chain[*chain_len];
+        if (obj_map(store, cur, obj) != 0)
+            return -1;
+        (*chain_len)++;
+
+        if (obj->hdr->img_size != chain[0].hdr->img_size) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        if (id_is_zero(obj->hdr->parent))
+            return 0;
+        id_to_str(obj->hdr->parent, cur);
+    }
+
+    errno = ELOOP;
+    return -1;
+}
+
+static void chain_unmap(obj_t *chain, size_t chain_len) {
+    for (size_t c = 0; c < chain_len; c++) {
+        obj_unmap(&chain[c]);
+    }
+}
+
+/* Contents of a page of the image a chain stores, NULL for a zero page */
+static const uint8_t *chain_page(const obj_t *chain, size_t chain_len,
+        uint64_t page) {
+    for (size_t c = 0; c < chain_len; c++) {
+        const obj_t *obj = &chain[c];
+        /* Pages are stored in increasing order */
+        uint64_t lo = 0, hi = obj->hdr->page_cnt;
+        while (lo < hi) {
+            uint64_t mid = lo + (hi - lo)/2;
+            if (obj->idx[mid] < page)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (lo < obj->hdr->page_cnt && obj->idx[lo] == page)
+            return obj->data + lo*IMGSTORE_PAGE_SIZE;
+    }
+    return NULL;
+}
+
+static int page_is_zero(const uint8_t *page) {
+    for (size_t j = 0; j < IMGSTORE_PAGE_SIZE; j++) {
+        if (page[j])
+            return 0;
+    }
+    return 1;
+}
+
+static int write_ref(imgstore_t *store, const char *name, const char *id_str) {
+    char path[PATH_MAX];
+    char tmp[PATH_MAX];
+
+    ref_path(store, name, path, sizeof(path));
+    tmp_path(store, "ref", tmp, sizeof(tmp));
+
+    FILE *ref = fopen(tmp, "w");
+    if (ref == NULL)
+        return -1;
+
+    int failed = fprintf(ref, "%s %s\n", id_str, name) < 0;
+    failed |= fclose(ref) != 0;
+
+    if (failed) {
+        unlink(tmp);
+        return -1;
+    }
+    return rename(tmp, path);
+}
+
+static int write_obj(imgstore_t *store, const char *id_str,
+        imgstore_obj_hdr_t *hdr, const uint64_t *hashes, uint64_t page_total,
+        const uint64_t *idx, const uint8_t *img, const uint8_t *last_page) {
+    char path[PATH_MAX];
+    char tmp[PATH_MAX];
+
+    tmp_path(store, "obj", tmp, sizeof(tmp));
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+
+    int failed = write_all(fd, hdr, sizeof(*hdr))
+        || write_all(fd, hashes, page_total*sizeof(uint64_t))
+        || write_all(fd, idx, hdr->page_cnt*sizeof(uint64_t));
+
+    struct iovec iov[WRITE_BATCH];
+    uint64_t i = 0;
+    while (!failed && i < hdr->page_cnt) {
+        int iovcnt = 0;
+        size_t len = 0;
+        for (; i < hdr->page_cnt && iovcnt < WRITE_BATCH; i++) {
+            /* The last page is padded with zeroes */
+            iov[iovcnt].iov_base = (idx[i] == page_total - 1)
+                ? (void*)last_page
+                : (void*)(img + idx[i]*hdr->page_size);
+            iov[iovcnt++].iov_len = hdr->page_size;
+            len += hdr->page_size;
+        }
+
+        ssize_t ret = writev(fd, iov, iovcnt);
+        failed = ret < 0 || (size_t)ret != len;
+    }
+
+    failed |= close(fd) != 0;
+    if (failed) {
+        unlink(tmp);
+        return -1;
+    }
+
+    obj_path(store, id_str, path, sizeof(path));
+    char *slash = strrchr(path, '/');
+    *slash = '\0';
+    make_dir(path);
+    *slash = '/';
+
+    return rename(tmp, path);
+}
+
+/**
+ * @brief Adds an image to the store
+ *
+ * Pages identical to the parent image are not stored again.  Images written
+ * by libpmfuzz in delta mode (see imgsnap.h) are materialized first.
+ *
+ * @param store Store to add the image to
+ * @param name Name to store the image with, replaces an existing image
+ * @param img_path Path to the image
+ * @param parent_name Name of the image this one was derived from, or NULL.
+ *        Ignored if the parent is not in the store or has a different size.
+ * @return 0 on success, -1 on failure
+ */
+int imgstore_put(imgstore_t *store, const char *name, const char *img_path,
+        const char *parent_name) {
+    char tmp_img[PATH_MAX] = "";
+    char id_str[IMGSTORE_ID_STR_LEN];
+    char parent_str[IMGSTORE_ID_STR_LEN];
+    uint8_t last_page[IMGSTORE_PAGE_SIZE];
+    imgstore_obj_hdr_t hdr;
+    obj_t *parent = NULL;
+    size_t parent_len = 0;
+    struct stat st;
+    uint8_t *img = NULL;
+    uint64_t *hashes = NULL;
+    uint64_t *idx = NULL;
+    int result = -1;
+
+    if (imgsnap_is_delta(img_path)) {
+        tmp_path(store, "img", tmp_img, sizeof(tmp_img));
+        if (imgsnap_apply_delta(img_path, tmp_img) != 0)
+            goto out;
+        img_path = tmp_img;
+    }
+
+    int fd = open(img_path, O_RDONLY);
+    if (fd < 0)
+        goto out;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        goto out;
+    }
+
+    uint64_t size = st.st_size;
+    uint64_t page_total = (size + IMGSTORE_PAGE_SIZE - 1)/IMGSTORE_PAGE_SIZE;
+    if (size > 0) {
+        img = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (img == MAP_FAILED) {
+            img = NULL;
+            close(fd);
+            goto out;
+        }
+    }
+    close(fd);
+
+    hashes = malloc((page_total + 1)*sizeof(uint64_t));
+    idx = malloc((page_total + 1)*sizeof(uint64_t));
+    if (hashes == NULL || idx == NULL)
+        goto out;
+
+    memset(last_page, 0, sizeof(last_page));
+    if (page_total > 0) {
+        uint64_t off = (page_total - 1)*IMGSTORE_PAGE_SIZE;
+        memcpy(last_page, img + off, size - off);
+    }
+
+    for (uint64_t i = 0; i < page_total; i++) {
+        const uint8_t *page = (i == page_total - 1)
+            ? last_page : img + i*IMGSTORE_PAGE_SIZE;
+        hashes[i] = hash_buf(page, IMGSTORE_PAGE_SIZE, 0);
+    }
+
+    /* Content address of the image */
+    uint8_t id[IMGSTORE_ID_LEN];
+    uint64_t id_lo = hash_buf(hashes, page_total*sizeof(uint64_t), size);
+    uint64_t id_hi = hash_buf(hashes, page_total*sizeof(uint64_t), ~size);
+    memcpy(id, &id_lo, sizeof(id_lo));
+    memcpy(id + sizeof(id_lo), &id_hi, sizeof(id_hi));
+    id_to_str(id, id_str);
+
+    char path[PATH_MAX];
+    obj_path(store, id_str, path, sizeof(path));
+    if (utime(path, NULL) == 0) {
+        /* Identical image already stored, touched for imgstore_gc() */
+        result = write_ref(store, name, id_str);
+        goto out;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, IMGSTORE_OBJ_MAGIC, sizeof(hdr.magic));
+    hdr.img_size = size;
+    hdr.page_size = IMGSTORE_PAGE_SIZE;
+
+    if (parent_name != NULL
+            && imgstore_resolve(store, parent_name, parent_str) == 0) {
+        parent = calloc(MAX_CHAIN_LEN, sizeof(obj_t));
+        if (parent == NULL)
+            goto out;
+        if (chain_map(store, parent_str, parent, &parent_len) == 0
+                && parent[0].hdr->img_size == size) {
+            str_to_id(parent_str, hdr.parent);
+        } else {
+            chain_unmap(parent, parent_len);
+            parent_len = 0;
+        }
+    }
+
+    uint64_t zero_hash = 0;
+    if (parent_len == 0) {
+        uint8_t *zero = calloc(1, IMGSTORE_PAGE_SIZE);
+        if (zero == NULL)
+            goto out;
+        zero_hash = hash_buf(zero, IMGSTORE_PAGE_SIZE, 0);
+        free(zero);
+    }
+
+    /* Do not trust the hash alone to drop a page, a collision would
+       restore the parent's bytes */
+    for (uint64_t i = 0; i < page_total; i++) {
+        const uint8_t *page = (i == page_total - 1)
+            ? last_page : img + i*IMGSTORE_PAGE_SIZE;
+        int same;
+        if (parent_len > 0) {
+            const uint8_t *parent_page = chain_page(parent, parent_len, i);
+            same = hashes[i] == parent[0].hashes[i]
+                && (parent_page != NULL
+                    ? memcmp(page, parent_page, IMGSTORE_PAGE_SIZE) == 0
+                    : page_is_zero(page));
+        } else {
+            same = hashes[i] == zero_hash && page_is_zero(page);
+        }
+        if (!same)
+            idx[hdr.page_cnt++] = i;
+    }
+
+    if (write_obj(store, id_str, &hdr, hashes, page_total, idx, img,
+            last_page) != 0) {
+        goto out;
+    }
+
+    result = write_ref(store, name, id_str);
+
+out:
+    if (parent != NULL)
+        chain_unmap(parent, parent_len);
+    free(parent);
+    if (img != NULL)
+        munmap(img, size);
+    free(hashes);
+    free(idx);
+    if (tmp_img[0])
+        unlink(tmp_img);
+    return result;
+}
+
+/**
+ * @brief Materializes an image from the store
+ *
+ * The destination is sized with ftruncate() and filled through a shared
+ * mapping, so only the pages stored somewhere in the chain of parents are
+ * written.  Pointing dest_path to a tmpfs or DAX file system avoids any
+ * block I/O.
+ *
+ * @param store Store to read the image from
+ * @param name Name of the image
+ * @param dest_path File to write the image to, overwritten if it exists
+ * @return 0 on success, -1 on failure
+ */
+int imgstore_get(imgstore_t *store, const char *name, const char *dest_path) {
+    char id_str[IMGSTORE_ID_STR_LEN];
+    obj_t *chain = NULL;
+    uint8_t *filled = NULL;
+    uint8_t *dest = NULL;
+    size_t chain_len = 0;
+    uint64_t size = 0;
+    int fd = -1;
+    int result = -1;
+
+    if (imgstore_resolve(store, name, id_str) != 0)
+        return -1;
+
+    chain = calloc(MAX_CHAIN_LEN, sizeof(obj_t));
+    if (chain == NULL)
+        return -1;
+
+    /* Map the object and all its parents */
+    if (chain_map(store, id_str, chain, &chain_len) != 0)
+        goto out;
+
+    size = chain[0].hdr->img_size;
+    uint64_t page_total = (size + IMGSTORE_PAGE_SIZE - 1)/IMGSTORE_PAGE_SIZE;
+
+    fd = open(dest_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, size) != 0)
+        goto out;
+
+    if (size > 0) {
+        dest = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        filled = calloc((page_total + 7)/8, 1);
+        if (dest == MAP_FAILED || filled == NULL) {
+            dest = NULL;
+            goto out;
+        }
+    }
+
+    /* Youngest object first, every page is written at most once */
+    for (size_t c = 0; c < chain_len; c++) {
+        obj_t *obj = &chain[c];
+        for (uint64_t i = 0; i < obj->hdr->page_cnt; i++) {
+            uint64_t page = obj->idx[i];
+            if (page >= page_total || filled[page/8] & (1 << (page%8)))
+                continue;
+            filled[page/8] |= 1 << (page%8);
+
+            uint64_t off = page*IMGSTORE_PAGE_SIZE;
+            size_t len = size - off < IMGSTORE_PAGE_SIZE
+                ? size - off : IMGSTORE_PAGE_SIZE;
+            memcpy(dest + off, obj->data + i*IMGSTORE_PAGE_SIZE, len);
+        }
+    }
+
+    result = 0;
+
+out:
+    if (dest != NULL)
+        munmap(dest, size);
+    if (fd >= 0)
+        close(fd);
+    chain_unmap(chain, chain_len);
+    free(chain);
+    free(filled);
+    return result;
+}
+
+static int gc_obj_cmp(const void *a, const void *b) {
+    return memcmp(((const gc_obj_t*)a)->id, ((const gc_obj_t*)b)->id,
+        IMGSTORE_ID_LEN);
+}
+
+static gc_obj_t *gc_find(gc_obj_t *objs, size_t cnt,
+        const uint8_t id[IMGSTORE_ID_LEN]) {
+    gc_obj_t key;
+    memcpy(key.id, id, IMGSTORE_ID_LEN);
+    return bsearch(&key, objs, cnt, sizeof(*objs), gc_obj_cmp);
+}
+
+/* Reads the id and parent of every object in the store */
+static int gc_scan(imgstore_t *store, gc_obj_t **objs, size_t *cnt) {
+    char path[PATH_MAX];
+    size_t cap = 0;
+
+    *objs = NULL;
+    *cnt = 0;
+
+    snprintf(path, sizeof(path), "%s/objects", store->root);
+    DIR *top = opendir(path);
+    if (top == NULL)
+        return -1;
+
+    struct dirent *sub_ent;
+    while ((sub_ent = readdir(top)) != NULL) {
+        if (strlen(sub_ent->d_name) != 2)
+            continue;
+
+        snprintf(path, sizeof(path), "%s/objects/%s", store->root,
+            sub_ent->d_name);
+        DIR *sub = opendir(path);
+        if (sub == NULL)
+            continue;
+
+        struct dirent *ent;
+        while ((ent = readdir(sub)) != NULL) {
+            char id_str[IMGSTORE_ID_STR_LEN];
+            imgstore_obj_hdr_t hdr;
+
+            if (strlen(ent->d_name) != IMGSTORE_ID_STR_LEN - 3)
+                continue;
+            snprintf(id_str, sizeof(id_str), "%s%s", sub_ent->d_name,
+                ent->d_name);
+
+            if (*cnt == cap) {
+                cap = cap ? 2*cap : 1024;
+                gc_obj_t *grown = realloc(*objs, cap*sizeof(**objs));
+                if (grown == NULL) {
+                    closedir(sub);
+                    closedir(top);
+                    return -1;
+                }
+                *objs = grown;
+            }
+
+            gc_obj_t *obj = &(*objs)[*cnt];
+            obj_path(store, id_str, path, sizeof(path));
+            int fd = open(path, O_RDONLY);
+            if (fd < 0)
+                continue;
+            int valid = pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr)
+                && memcmp(hdr.magic, IMGSTORE_OBJ_MAGIC,
+                    sizeof(hdr.magic)) == 0
+                && str_to_id(id_str, obj->id) == 0;
+            close(fd);
+
+            /* Leave anything that is not an object alone */
+            if (!valid)
+                continue;
+
+            memcpy(obj->parent, hdr.parent, IMGSTORE_ID_LEN);
+            obj->live = 0;
+            (*cnt)++;
+        }
+        closedir(sub);
+    }
+    closedir(top);
+
+    qsort(*objs, *cnt, sizeof(**objs), gc_obj_cmp);
+    return 0;
+}
+
+/**
+ * @brief Removes the objects no image refers to, directly or as a parent
+ *
+ * Mark and sweep: every ref marks its object and the object's chain of
+ * parents, unmarked objects are deleted.  Objects written or reused after
+ * the collection started are kept, but a put racing with the sweep can
+ * still lose its object: do not collect a store that is being written to.
+ *
+ * @param store Store to collect
+ * @param keep If not NULL, called with the name and ref modification time
+ *        of every image in the store, the images it returns 0 for are
+ *        removed first
+ * @param arg Passed to keep
+ * @param freed If not NULL, set to the number of objects removed
+ * @return 0 on success, -1 on failure
+ */
+int imgstore_gc(imgstore_t *store, imgstore_keep_fn keep, void *arg,
+        uint64_t *freed) {
+    char path[PATH_MAX];
+    gc_obj_t *objs = NULL;
+    size_t cnt = 0;
+    char *line = NULL;
+    size_t line_len = 0;
+    int result = -1;
+    time_t start = time(NULL);
+
+    if (freed != NULL)
+        *freed = 0;
+
+    if (gc_scan(store, &objs, &cnt) != 0)
+        goto out;
+
+    /* Mark */
+    snprintf(path, sizeof(path), "%s/refs", store->root);
+    DIR *refs = opendir(path);
+    if (refs == NULL)
+        goto out;
+
+    struct dirent *ent;
+    while ((ent = readdir(refs)) != NULL) {
+        uint8_t id[IMGSTORE_ID_LEN];
+
+        if (ent->d_name[0] == '.')
+            continue;
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/refs/%s", store->root, ent->d_name);
+        FILE *ref = fopen(path, "r");
+        if (ref == NULL)
+            continue;
+
+        ssize_t len = fstat(fileno(ref), &st) == 0
+            ? getline(&line, &line_len, ref) : -1;
+        fclose(ref);
+        if (len <= IMGSTORE_ID_STR_LEN || line[IMGSTORE_ID_STR_LEN - 1] != ' '
+                || str_to_id(line, id) != 0) {
+            continue;
+        }
+        if (line[len - 1] == '\n')
+            line[len - 1] = '\0';
+
+        if (keep != NULL
+                && !keep(line + IMGSTORE_ID_STR_LEN, st.st_mtime, arg)) {
+            unlink(path);
+            continue;
+        }
+
+        /* Chains shared with an already marked image stop early */
+        gc_obj_t *obj = gc_find(objs, cnt, id);
+        for (size_t depth = 0; obj != NULL && !obj->live
+                && depth < MAX_CHAIN_LEN; depth++) {
+            obj->live = 1;
+            obj = id_is_zero(obj->parent)
+                ? NULL : gc_find(objs, cnt, obj->parent);
+        }
+    }
+    closedir(refs);
+
+    /* Sweep, imgstore_put() touches the objects it reuses */
+    for (size_t i = 0; i < cnt; i++) {
+        char id_str[IMGSTORE_ID_STR_LEN];
+        struct stat st;
+        if (objs[i].live)
+            continue;
+
+        id_to_str(objs[i].id, id_str);
+        obj_path(store, id_str, path, sizeof(path));
+        if (stat(path, &st) != 0 || st.st_mtime >= start)
+            continue;
+        if (unlink(path) == 0 && freed != NULL)
+            (*freed)++;
+    }
+
+    result = 0;
+
+out:
+    free(line);
+    free(objs);
+    return result;
+}
@@ -0,0 +1,72 @@
+/**
+ *  @file        imgstore.h
+ *  @details     Content-addressed store for PM images
+ *
+ * PM images generated along a testcase lineage differ from their parent
+ * image in only a few pages.  The store keeps every image as an object
+ * holding the pages that differ from its parent object, and materializes
+ * images on demand by walking the chain of parents.
+ *
+ * ### Layout
+ * ```
+ * <root>/objects/<id[0:2]>/<id[2:]>   Image objects
+ * <root>/refs/<hash of name>          "<object id> <name>"
+ * <root>/tmp/                         Objects and refs being written
+ * ```
+ *
+ * ### Object format
+ * ```
+ * imgstore_obj_hdr_t | uint64_t page_hash[page_total] |
+ *   uint64_t page_idx[page_cnt] | page_cnt x page_size bytes of data
+ * ```
+ * `page_hash` covers every page of the image, so a child object can be
+ * diffed against its parent without materializing the parent.  Objects
+ * without a parent omit the all-zero pages.  The object id is a hash of the
+ * image size and page hashes, identical images share an object.
+ *
+ * Removing an image only removes its ref, objects are shared.  Objects no
+ * ref reaches, directly or through the parents, are deleted by
+ * imgstore_gc().
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define IMGSTORE_OBJ_MAGIC      "PMFZOBJ1"
+#define IMGSTORE_PAGE_SIZE      (4096)
+#define IMGSTORE_ID_LEN         (16)    /* bytes */
+#define IMGSTORE_ID_STR_LEN     (2*IMGSTORE_ID_LEN + 1)
+
+/**
+ * @brief Header of an image object
+ */
+typedef struct {
+    char        magic[8];
+    uint64_t    img_size;
+    uint32_t    page_size;
+    uint32_t    reserved;
+    uint8_t     parent[IMGSTORE_ID_LEN];    /* All zero if no parent */
+    uint64_t    page_cnt;                   /* Number of pages stored */
+} imgstore_obj_hdr_t;
+
+typedef struct imgstore imgstore_t;
+
+/* Returns non-zero to keep the image with the name and ref modification
+   time, see imgstore_gc() */
+typedef int (*imgstore_keep_fn)(const char *name, time_t mtime, void *arg);
+
+imgstore_t *imgstore_open(const char *root);
+void imgstore_close(imgstore_t *store);
+
+int imgstore_put(imgstore_t *store, const char *name, const char *img_path,
+    const char *parent_name);
+int imgstore_get(imgstore_t *store, const char *name, const char *dest_path);
+int imgstore_has(imgstore_t *store, const char *name);
+int imgstore_remove(imgstore_t *store, const char *name);
+int imgstore_resolve(imgstore_t *store, const char *name,
+    char id_str[IMGSTORE_ID_STR_LEN]);
+int imgstore_gc(imgstore_t *store, imgstore_keep_fn keep, void *arg,
+    uint64_t *freed);
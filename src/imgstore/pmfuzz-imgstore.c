@@ -0,0 +1,150 @@
+/**
+ *  @file        pmfuzz-imgstore.c
+ *  @details     Command line interface to the PM image store, see imgstore.h
+ */
+
+#include "imgstore.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define HELP_STR \
+    "Usage: pmfuzz-imgstore <store dir> <command> [args]\n" \
+    "Commands:\n" \
+    "  put <name> <image> [parent name]  Add an image, stored as a delta\n" \
+    "                                    against the parent if given\n" \
+    "  get <name> <dest>                 Materialize an image to dest\n" \
+    "  has <name>                        Exit with 0 if the image exists\n" \
+    "  id <name>                         Print the object id of an image\n" \
+    "  rm <name>                         Remove an image\n" \
+    "  gc [live list]                    Delete the objects no image uses,\n" \
+    "                                    after removing the images not\n" \
+    "                                    named in the live list if given\n"
+
+/* Sorted names of the live images, read from the gc live list.  Images
+   written after the list's modification time are kept too, the list's
+   writer sets it to when it started listing. */
+typedef struct {
+    char      **names;
+    size_t      cnt;
+    time_t      since;
+} live_list_t;
+
+static int str_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int live_list_read(const char *path, live_list_t *live) {
+    char *line = NULL;
+    size_t line_len = 0;
+    size_t cap = 0;
+    ssize_t len;
+
+    struct stat st;
+    FILE *list = fopen(path, "r");
+    if (list == NULL)
+        return -1;
+    if (fstat(fileno(list), &st) != 0) {
+        fclose(list);
+        return -1;
+    }
+    live->since = st.st_mtime;
+
+    live->names = NULL;
+    live->cnt = 0;
+    while ((len = getline(&line, &line_len, list)) > 0) {
+        if (line[len - 1] == '\n')
+            line[len - 1] = '\0';
+
+        if (live->cnt == cap) {
+            cap = cap ? 2*cap : 1024;
+            char **grown = realloc(live->names, cap*sizeof(char*));
+            if (grown == NULL)
+                break;
+            live->names = grown;
+        }
+        live->names[live->cnt++] = line;
+        line = NULL;
+        line_len = 0;
+    }
+
+    free(line);
+    int failed = ferror(list) || (len > 0);
+    fclose(list);
+
+    qsort(live->names, live->cnt, sizeof(char*), str_cmp);
+    return failed ? -1 : 0;
+}
+
+static int live_list_has(const char *name, time_t mtime, void *arg) {
+    const live_list_t *live = arg;
+    return mtime >= live->since
+        || bsearch(&name, live->names, live->cnt, sizeof(char*),
+            str_cmp) != NULL;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, HELP_STR);
+        return 2;
+    }
+
+    const char *cmd = argv[2];
+    const char *name = argc > 3 ? argv[3] : "";
+    int ret = -1;
+
+    imgstore_t *store = imgstore_open(argv[1]);
+    if (store == NULL) {
+        fprintf(stderr, "Unable to open store %s: %s\n", argv[1],
+            strerror(errno));
+        return 1;
+    }
+
+    if (strcmp(cmd, "put") == 0 && (argc == 5 || argc == 6)) {
+        ret = imgstore_put(store, name, argv[4], argc == 6 ? argv[5] : NULL);
+    } else if (strcmp(cmd, "get") == 0 && argc == 5) {
+        ret = imgstore_get(store, name, argv[4]);
+    } else if (strcmp(cmd, "has") == 0 && argc == 4) {
+        int found = imgstore_has(store, name);
+        imgstore_close(store);
+        return found ? 0 : 1;
+    } else if (strcmp(cmd, "id") == 0 && argc == 4) {
+        char id_str[IMGSTORE_ID_STR_LEN];
+        ret = imgstore_resolve(store, name, id_str);
+        if (ret == 0)
+            printf("%s\n", id_str);
+    } else if (strcmp(cmd, "rm") == 0 && argc == 4) {
+        ret = imgstore_remove(store, name);
+    } else if (strcmp(cmd, "gc") == 0 && (argc == 3 || argc == 4)) {
+        live_list_t live = {NULL, 0, 0};
+        uint64_t freed = 0;
+        ret = argc == 4 ? live_list_read(argv[3], &live) : 0;
+        if (ret == 0) {
+            ret = imgstore_gc(store, argc == 4 ? live_list_has : NULL, &live,
+                &freed);
+        }
+        if (ret == 0)
+            printf("%llu\n", (unsigned long long)freed);
+
+        for (size_t i = 0; i < live.cnt; i++) {
+            free(live.names[i]);
+        }
+        free(live.names);
+    } else {
+        fprintf(stderr, HELP_STR);
+        imgstore_close(store);
+        return 2;
+    }
+
+    if (ret != 0) {
+        fprintf(stderr, "%s %s failed: %s\n", cmd, name, strerror(errno));
+    }
+
+    imgstore_close(store);
+    return ret == 0 ? 0 : 1;
+}
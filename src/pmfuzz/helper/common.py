@@ -234,15 +234,39 @@ def get_compress_cmd(src, dest, verbose):
 
     return cmd
 
-def compress(src, dest, verbose, level=6, extra_params=[]):
+def compress(src, dest, verbose, level=6, extra_params=[], parent=None):
     """ Compresses a file from src to dest 
+
+    If the image store is enabled (see interfaces.imgstore), the file is added
+    to the store instead and dest is a reference to it. The file name 
+    decompress() restores is then the name of dest without `.tar.gz`.
+
     @param src Full path to the source to compress
     @param dest Full path to the destination compressed file
     @param verbose Verbose logging to stdout
     @param level Compression level to use, should belong to [1,9]
+    @param parent Path to the compressed parent image of src, if any. Lets the
+           image store keep src as a delta against its parent.
     @return None
     """
 
+    from interfaces import imgstore
+
+    store = imgstore.get_store()
+    if store is not None:
+        name = path.abspath(dest)
+        parent_name = None
+        if parent is not None and imgstore.is_ref(parent):
+            _, parent_name, _ = imgstore.read_ref(parent)
+
+        if verbose:
+            printv('Storing ' + src + ' -> ' + dest)
+
+        store.put(name, src, parent_name)
+        imgstore.write_ref(dest, store, name, 
+            path.basename(dest).replace('.tar.gz', ''))
+        return
+
     cmd = get_compress_cmd(src, dest, verbose) + extra_params
 
     if verbose:
@@ -265,14 +289,29 @@ def compress(src, dest, verbose, level=6, extra_params=[]):
     )
 
 def get_decompress_cmd(src, dest, verbose):
+    from interfaces import imgreplay
+    from interfaces import imgstore
+
     dest_dir = path.dirname(dest)
 
+    if imgreplay.is_ref(src):
+        # Regenerates the crash site only when the command runs
+        return imgreplay.get_materialize_cmd(src, dest_dir, verbose)
+
+    if imgstore.is_ref(src):
+        store, name, fname = imgstore.read_ref(src)
+        return store.cmd('get', name, path.join(dest_dir, fname))
+
     cmd = ['tar', 'xzf', src, '-C', dest_dir]
 
     return cmd    
 
 def decompress(src, dest, verbose, verify=False):
     """ Deompresses a file from src to dest 
+
+    References to the image store written by compress() are materialized from
+    the store, replay references (see interfaces.imgreplay) are regenerated.
+
     @param src Path to the compressed file
     @param dest Path to the decompressed file
     @param verbose Path to the compressed file
@@ -281,6 +320,15 @@ def decompress(src, dest, verbose, verify=False):
     @return None
     """
 
+    from interfaces import imgreplay
+
+    if imgreplay.is_ref(src):
+        # Same process, the replay cache is already configured
+        if verbose:
+            printv('Replaying ' + src + ' -> ' + dest)
+        imgreplay.materialize(src, path.dirname(dest), verbose)
+        return
+
     cmd = get_decompress_cmd(src, dest, verbose)
 
     if verbose:
@@ -6,7 +6,9 @@
 
 License Text
 """
+import hashlib
 import os
+import re
 import tempfile
 
 from io import StringIO
@@ -16,12 +18,70 @@
 from helper.common import *
 from handlers import name_handler as nh
 
+SHARED_VIRGIN_PM_ENV = 'PMFUZZ_SHARED_VIRGIN_PM'
+IMG_LIST_ENV = 'PMFUZZ_IMG_LIST'
+IMG_LINK_ENV = 'PMFUZZ_IMG_LINK'
+
+# Private (copy-on-write) mapping of the image, see mmap_posix.c in pmdk
+FAKE_MMAP_PRIVATE = '2'
+
+def get_shared_virgin_pm_name(outdir:str):
+    """ @brief Name of the shared PM map of the AFL instances writing to 
+    outdir 
+
+    >>> get_shared_virgin_pm_name('/tmp/out')
+    '/pmfuzz-virgin-pm-b8c1d4627bcb9520'
+    """
+
+    digest = hashlib.sha1(os.path.abspath(outdir).encode()).hexdigest()
+    return '/pmfuzz-virgin-pm-' + digest[:16]
+
+def write_img_list(list_f:str, imgs:list):
+    """ @brief Writes the PMFUZZ_IMG_LIST of a multi image instance, queue 
+    entries refer to the images by their position in imgs """
+
+    with open(list_f, 'w') as obj:
+        obj.write(''.join(os.path.abspath(img) + '\n' for img in imgs))
+
+def get_img_env(list_f:str, link:str):
+    """ @brief Environment of an AFL instance fuzzing on the images of list_f,
+    the target opens its image from link 
+    
+    >>> env = get_img_env('/tmp/list', '/tmp/img')
+    >>> env['PMFUZZ_IMG_LIST'], env['PMFUZZ_IMG_LINK'], env['USE_FAKE_MMAP']
+    ('/tmp/list', '/tmp/img', '2')
+    """
+
+    # The image is swapped under the target for every queue entry, it has to
+    # map it privately and not modify it
+    return {
+        IMG_LIST_ENV    : list_f, 
+        IMG_LINK_ENV    : link,
+        'USE_FAKE_MMAP' : FAKE_MMAP_PRIVATE,
+    }
+
+def get_img_id(tc_name:str):
+    """ @brief Position in the PMFUZZ_IMG_LIST of the image a queue entry of a
+    multi image instance runs on, None for other queue entries 
+
+    >>> get_img_id('id:000003,src:000001,img:000001,time:2,op:flip1,pos:0')
+    1
+    >>> get_img_id('id:000001,time:0,img:000000,orig:id=000001.testcase')
+    0
+    >>> get_img_id('id:000003,src:000001,time:2,op:flip1,pos:0') is None
+    True
+    """
+
+    match = re.search(r',img:(\d+)', tc_name)
+    return None if match is None else int(match.group(1))
+
 def get_fuzzer_stats(outdir):
     result = (chain.from_iterable(glob(x[0] + '/fuzzer_stats', recursive=True) for x in os.walk(outdir)))
     return result
 
 def gen_afl_cmd(indir:str, outdir:str, cfg:dict, tgtcmd:list, slave:bool=False, 
-                coreid:int=0, persist_tgt:bool=False, verbose:bool=False):
+                coreid:int=0, persist_tgt:bool=False, verbose:bool=False,
+                extra_env:dict=None):
     """ @brief Generates an AFL command using configuration and parameters 
     
     @return A tuple with enivronment and cmd for give afl parameters """
@@ -36,6 +96,12 @@ def gen_afl_cmd(indir:str, outdir:str, cfg:dict, tgtcmd:list, slave:bool=False,
         ppp_env = cfg('afl.prioritize_pm_path.env.disable').split('=')
     
     env.update({ppp_env[0]: ppp_env[1]})
+
+    if cfg('afl.shared_virgin_pm.enable'):
+        env.update({SHARED_VIRGIN_PM_ENV: get_shared_virgin_pm_name(outdir)})
+
+    if extra_env != None:
+        env.update(extra_env)
     
     afl_bin     = [os.path.join(cfg('pmfuzz.bin_dir'), 'afl-fuzz')]
     afl_indir   = ['-i', indir]
@@ -151,10 +217,20 @@ def gen_tgt_img(tgtcmd:list, cfg, verbose:bool=False):
     os.close(fd)
 
 def run_afl(indir:str, outdir:str, tgtcmd:list, cfg:dict, cores:int=1, 
-            verbose:bool=False, persist_tgt=False, dry_run=False, gen_img=True):
-    """ @brief Run AFL """
+            verbose:bool=False, persist_tgt=False, dry_run=False, gen_img=True,
+            extra_env:dict=None):
+    """ @brief Run AFL 
+    
+    @param extra_env Environment added to the configured one, e.g., 
+           get_img_env() """
 
     pids = []
+
+    # Instances started together begin with no PM path found
+    if cfg('afl.shared_virgin_pm.enable') and not dry_run:
+        shm_f = '/dev/shm' + get_shared_virgin_pm_name(outdir)
+        if os.path.isfile(shm_f):
+            os.remove(shm_f)
     for coreid in range(cores):
         fd, imgname = tempfile.mkstemp(prefix='pmfuzz-tmp-img-', 
             dir=cfg['pmfuzz']['img_loc'])
@@ -185,7 +261,8 @@ def run_afl(indir:str, outdir:str, tgtcmd:list, cfg:dict, cores:int=1,
             fuzzer_name = 'slave_fuzzer_' + str(coreid)
 
         env, cmd = gen_afl_cmd(indir, outdir, cfg, tgtcmd_loc, slave, 
-                                coreid=coreid, persist_tgt=False, verbose=verbose)
+                                coreid=coreid, persist_tgt=False, verbose=verbose,
+                                extra_env=extra_env)
         
         tf.write(bytearray('Output from coreid %d\nenv:%s\ncmd:%s\n' 
                     % (coreid, str(env), str(cmd)), encoding='ascii'))
@@ -12,6 +12,7 @@
 import tempfile
 
 import handlers.name_handler as nh
+import interfaces.imgsnap as imgsnap
 
 from helper.common import abort
 from helper.common import abort_if
@@ -22,7 +23,8 @@
 def get_failure_inj_env(cfg, create):
     env:dict = {}
 
-    env = cfg('target.env')
+    # Copy, the config is shared by all runs
+    env = dict(cfg('target.env'))
     if create:
         env.update(cfg('pmfuzz.failure_injection.img_gen_mode.create_env'))
     else:
@@ -44,10 +46,12 @@ def gen_failure_inj_cmd(cfg, tgtcmd, imgpath, create, verbose=False):
     return (env, cmd)
 
 def run_failure_inj(cfg, tgtcmd, imgpath, testcase_f, clean_name, 
-        create, verbose=False):
+        create, verbose=False, extra_env={}):
     """ @brief Run failure injection on an image 
     @param create If true, inject the failure to the process of creating the
                   image
+    @param extra_env Environment overriding the configured one, e.g., to
+                  reproduce crash sites (see interfaces.imgreplay)
     @return None"""
 
     if not create and not os.path.isfile(imgpath):
@@ -55,6 +59,7 @@ def run_failure_inj(cfg, tgtcmd, imgpath, testcase_f, clean_name,
 
     env, cmd = gen_failure_inj_cmd(cfg, cfg.tgtcmd, imgpath, create, verbose)
     env.update({"FI_IMG_SUFFIX": clean_name.replace('.testcase', '')})
+    env.update(extra_env)
 
     if verbose:
         printv('Failure Injection:')
@@ -83,4 +88,7 @@ def run_failure_inj(cfg, tgtcmd, imgpath, testcase_f, clean_name,
     descr_str, success = translate_exit_code(exit_code)
     if not success:
         abort('Failure injection for pid %d failed: %s' \
-            % (os.getpid(), descr_str))
\ No newline at end of file
+            % (os.getpid(), descr_str))
+
+    # The stages only handle full images (FI_SNAPSHOT=DELTA)
+    imgsnap.materialize_run(imgpath, env['FI_IMG_SUFFIX'])
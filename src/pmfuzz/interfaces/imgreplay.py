@@ -0,0 +1,358 @@
+"""
+@file       imgreplay.py
+@details    Regenerates crash sites on demand instead of storing them
+@auhor      author
+@copyright  LICENSE
+
+License Text
+
+When replay is enabled, the stages write a small reference file in place of
+each crash site's .tar.gz archive. The reference records what generated the
+crash site: the parent image, the testcase and the failure id, along with
+the sha256 sum of the crash site.
+helper.common.decompress() recognizes reference files and regenerates the
+image by running the target on the parent image with libpmfuzz in IMG_REP
+mode, and aborts if the regenerated image does not match the sum. Storage
+then grows with the testcases instead of the crash sites.
+helper.common.get_decompress_cmd() returns a pmfuzz-replay.py command
+instead, so the target only runs when the command does.
+
+One replay run regenerates every crash site its testcase generated, so the
+images land in a bounded LRU cache (on tmpfs) where later requests for the
+sibling crash sites find them.
+
+Reference file format (single line):
+    PMFUZZ-REPLAY-REF <parent> <suffix> <failure id> <sibling ids>
+        <file name> <sha256> <testcase>
+
+<parent> is the path to the compressed parent image, or `-` for crash sites
+generated on an empty image (stage 1). <sibling ids> are the comma separated
+failure ids of all crash sites kept for the testcase, and <testcase> is the
+base64 encoded testcase.
+"""
+
+import base64
+import hashlib
+import os
+import re
+import stat
+import sys
+import tempfile
+
+from glob import glob
+from os import path
+from shutil import copy2, copyfile, move
+
+import interfaces.failureinjection as finj
+import handlers.name_handler as nh
+
+from helper.common import abort
+from helper.common import abort_if
+from helper.common import sha256sum
+from helper.prettyprint import printv
+
+REF_MAGIC   = 'PMFUZZ-REPLAY-REF'
+NO_PARENT   = '-'
+
+# Cache used by decompress(), set by configure()
+_cache = None
+
+class ReplayRef:
+    """ @class Contents of a reference file """
+
+    def __init__(self, parent, suffix, failure_id, ids, fname, img_hash,
+            testcase):
+        self.parent     = parent
+        self.suffix     = suffix
+        self.failure_id = failure_id
+        self.ids        = ids
+        self.fname      = fname
+        self.img_hash   = img_hash
+        self.testcase   = testcase
+
+    def key(self):
+        """ @brief Identifies the replay run that regenerates this crash site,
+        shared by all its siblings """
+
+        digest = hashlib.sha1()
+        digest.update(self.parent.encode())
+        digest.update(self.suffix.encode())
+        digest.update(self.testcase)
+        return digest.hexdigest()
+
+class ReplayCache:
+    """ @class LRU cache of regenerated crash sites
+
+    Entries are files named `<key>.id=<failure id>`, their modification time
+    is their last use. The cache is shared by all the processes of a run,
+    every update is a rename or unlink. """
+
+    def __init__(self, cfg, root, max_bytes, verbose):
+        self.cfg        = cfg
+        self.root       = root
+        self.max_bytes  = max_bytes
+        self.verbose    = verbose
+
+        os.makedirs(root, exist_ok=True)
+
+    def entry(self, key, failure_id):
+        return path.join(self.root, '%s.id=%06d' % (key, failure_id))
+
+    def lookup(self, key, failure_id):
+        """ @return Path to the cached image, None on a miss """
+
+        entry = self.entry(key, failure_id)
+        try:
+            os.utime(entry)
+        except FileNotFoundError:
+            return None
+        return entry
+
+    def insert(self, key, failure_id, img):
+        """ @brief Moves img into the cache """
+
+        os.rename(img, self.entry(key, failure_id))
+
+    def add(self, ref, img):
+        """ @brief Moves a crash site generated by a stage into the cache, 
+        it is likely to be used soon """
+
+        fd, tmp = tempfile.mkstemp(prefix='pmfuzz-replay-add-', dir=self.root)
+        os.close(fd)
+        move(img, tmp)
+        self.insert(ref.key(), ref.failure_id, tmp)
+
+    def evict(self):
+        """ @brief Removes the least recently used images over the limit 
+
+        >>> cache = ReplayCache(None, tempfile.mkdtemp(), 8, False)
+        >>> for i in range(3):
+        ...     with open(cache.entry('k', i), 'w') as obj:
+        ...         _ = obj.write('abcd')
+        ...     os.utime(cache.entry('k', i), (i, i))
+        >>> _ = cache.lookup('k', 0)
+        >>> cache.evict()
+        >>> sorted(os.listdir(cache.root))
+        ['k.id=000000', 'k.id=000002']
+        """
+
+        entries = []
+        total = 0
+        for fname in os.listdir(self.root):
+            try:
+                st = os.stat(path.join(self.root, fname))
+            except FileNotFoundError:
+                continue
+            # Skip the work directories of running replays
+            if not stat.S_ISREG(st.st_mode):
+                continue
+            entries.append((st.st_mtime, st.st_size, fname))
+            total += st.st_size
+
+        for _, size, fname in sorted(entries):
+            if total <= self.max_bytes:
+                break
+            try:
+                os.remove(path.join(self.root, fname))
+            except FileNotFoundError:
+                pass
+            total -= size
+
+    def replay(self, ref):
+        """ @brief Regenerates all the crash sites of ref's testcase with a
+        single run of the target and adds them to the cache """
+
+        from helper.common import decompress
+
+        workdir = tempfile.mkdtemp(prefix='pmfuzz-replay-', dir=self.root)
+        tc_f = path.join(workdir, 'testcase')
+        list_f = path.join(workdir, 'failure_list')
+
+        with open(tc_f, 'wb') as obj:
+            obj.write(ref.testcase)
+        with open(list_f, 'w') as obj:
+            obj.write(''.join('%d\n' % failure_id for failure_id in ref.ids))
+
+        # Delta snapshots would only hold the pages changed since the
+        # previous image
+        env = {
+            'FI_MODE'       : 'IMG_REP',
+            'FAILURE_LIST'  : list_f,
+            'FI_SNAPSHOT'   : 'SYNC',
+        }
+
+        try:
+            if ref.parent == NO_PARENT:
+                from helper.target import TempEmptyImage
+
+                with TempEmptyImage(self.cfg, self.verbose) as tmp_img:
+                    img = path.join(workdir, 'parent.' + nh.PM_IMG_EXT)
+                    copy2(tmp_img, img)
+            else:
+                # The parent might be a replayed crash site itself
+                decompress(ref.parent, workdir + '/', self.verbose)
+                img = glob(path.join(workdir, '*.' + nh.CRASH_SITE_EXT)) \
+                    + glob(path.join(workdir, '*.' + nh.PM_IMG_EXT))
+                abort_if(len(img) != 1,
+                    'Cannot find parent image of ' + ref.fname)
+                img = img[0]
+
+            finj.run_failure_inj(self.cfg, self.cfg.tgtcmd, img, tc_f,
+                ref.suffix, create=False, verbose=self.verbose,
+                extra_env=env)
+
+            for crash_site in glob(path.join(workdir, '*.id=*.'
+                    + nh.CRASH_SITE_EXT)):
+                if crash_site != img:
+                    self.insert(ref.key(), get_failure_id(crash_site), 
+                        crash_site)
+        finally:
+            for fname in os.listdir(workdir):
+                os.remove(path.join(workdir, fname))
+            os.rmdir(workdir)
+
+        self.evict()
+
+    def materialize(self, ref, dest):
+        """ @brief Copies the image of ref to dest, replaying it on a miss 
+
+        Aborts if the image does not match the sum in ref, a replay that
+        does not reproduce the crash site would otherwise go unnoticed. """
+
+        for _ in range(2):
+            cached = self.lookup(ref.key(), ref.failure_id)
+            if cached is None:
+                if self.verbose:
+                    printv('Replaying %s' % ref.fname)
+                self.replay(ref)
+                cached = self.lookup(ref.key(), ref.failure_id)
+                abort_if(cached is None,
+                    'Replay did not regenerate ' + ref.fname)
+
+            try:
+                copyfile(cached, dest)
+            except FileNotFoundError:
+                # Evicted by another process in between
+                continue
+
+            img_hash = sha256sum(dest)
+            abort_if(img_hash != ref.img_hash,
+                'Replay of %s does not match its sha256 sum: %s, expected %s' \
+                    % (ref.fname, img_hash, ref.img_hash))
+            return
+
+        abort('Cannot materialize ' + ref.fname)
+
+def configure(cfg, verbose):
+    """ @brief Enables replay references for crash sites if the config asks
+    for it
+    @param cfg Config object
+    @return None """
+
+    global _cache
+
+    if cfg('pmfuzz.img_replay.enable'):
+        _cache = ReplayCache(cfg, cfg('pmfuzz.img_replay.cache_dir'),
+            int(cfg('pmfuzz.img_replay.cache_size_mb')) << 20, verbose)
+    else:
+        _cache = None
+
+def get_cache():
+    """ @brief Returns the configured cache, None if replay is disabled """
+
+    return _cache
+
+def is_ref(fpath):
+    """ @brief Checks if a file is a replay reference """
+
+    try:
+        with open(fpath, 'rb') as obj:
+            return obj.read(len(REF_MAGIC)) == REF_MAGIC.encode()
+    except OSError:
+        return False
+
+def read_ref(fpath):
+    """ @brief Reads a reference file
+    @return ReplayRef """
+
+    with open(fpath, 'r') as obj:
+        _, parent, suffix, failure_id, ids, fname, img_hash, testcase \
+            = obj.readline().split()
+
+    return ReplayRef(parent, suffix, int(failure_id),
+        [int(i) for i in ids.split(',')], fname, img_hash, 
+        base64.b64decode(testcase))
+
+def write_ref(fpath, parent, suffix, failure_id, ids, img_hash, testcase_f):
+    """ @brief Writes a reference file in place of a crash site's archive
+
+    @param fpath Path to write the reference to, the crash site's .tar.gz
+    @param parent Path to the compressed parent image, None for an empty image
+    @param suffix Clean name of the testcase, FI_IMG_SUFFIX for the target
+    @param failure_id Failure id of the crash site
+    @param ids Failure ids of all the crash sites kept for the testcase
+    @param img_hash sha256 sum of the crash site
+    @param testcase_f Path to the testcase
+    @return ReplayRef written 
+
+    >>> tmp = tempfile.mkdtemp()
+    >>> with open(path.join(tmp, 'tc'), 'wb') as obj:
+    ...     _ = obj.write(b'testcase')
+    >>> ref = write_ref(path.join(tmp, 'img.id=000002.cs.tar.gz'), None, 
+    ...     'tc', 2, [2, 1], 'ab12', path.join(tmp, 'tc'))
+    >>> ref.parent, ref.ids, ref.fname, ref.img_hash, ref.testcase
+    ('-', [1, 2], 'img.id=000002.cs', 'ab12', b'testcase')
+    """
+
+    with open(testcase_f, 'rb') as obj:
+        testcase = base64.b64encode(obj.read()).decode()
+
+    parent = NO_PARENT if parent is None else path.abspath(parent)
+    fname = path.basename(fpath).replace('.tar.gz', '')
+
+    with open(fpath, 'w') as obj:
+        obj.write('%s %s %s %d %s %s %s %s\n' % (REF_MAGIC, parent, suffix,
+            failure_id, ','.join(str(i) for i in sorted(ids)), fname,
+            img_hash, testcase))
+
+    return read_ref(fpath)
+
+def get_failure_id(crash_site):
+    """ @brief Failure id of a crash site from its name
+
+    >>> get_failure_id('id=000001,id=000002.id=000011.crash_site')
+    11
+    """
+
+    return int(re.search(r'\.id=(\d+)\.' + nh.CRASH_SITE_EXT + '$',
+        crash_site).group(1))
+
+def get_materialize_cmd(fpath, dest_dir, verbose):
+    """ @brief Command that regenerates the crash site of a reference file
+    into dest_dir, for scripts that run outside of this process
+    @return List with the command """
+
+    abort_if(_cache is None,
+        'Replay reference %s found with replay disabled' % fpath)
+
+    script = path.join(path.dirname(path.realpath(__file__)), '..',
+        'pmfuzz-replay.py')
+    cmd = [sys.executable, path.realpath(script), 
+        path.abspath(_cache.cfg.cfg_f), path.abspath(fpath), dest_dir]
+    if verbose:
+        cmd.append('--verbose')
+
+    return cmd
+
+def materialize(fpath, dest_dir, verbose):
+    """ @brief Regenerates the crash site of a reference file into dest_dir,
+    with the name its archive would have restored
+    @return Path to the image """
+
+    abort_if(_cache is None,
+        'Replay reference %s found with replay disabled' % fpath)
+
+    ref = read_ref(fpath)
+    dest = path.join(dest_dir, ref.fname)
+    _cache.materialize(ref, dest)
+    return dest
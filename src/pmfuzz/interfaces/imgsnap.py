@@ -0,0 +1,158 @@
+"""
+@file       imgsnap.py
+@details    Materializes the delta crash images written by libpmfuzz
+@auhor      author
+@copyright  LICENSE
+
+License Text
+
+With FI_SNAPSHOT=DELTA, libpmfuzz writes every crash image after the first
+one of a pool as a delta against the previous image, named
+`<image name>.delta` (see include/imgsnap.h for the format). The stages only
+handle full images, so the deltas of a failure injection run are
+materialized to full images, under the name without the suffix, as soon as
+the run exits.
+"""
+
+import os
+import struct
+
+from glob import glob
+from shutil import copyfile
+
+DELTA_MAGIC     = b'PMFZDLT1'
+DELTA_SUFFIX    = '.delta'
+
+# imgsnap_delta_hdr_t: magic, img_size, page_size, parent_len, page_cnt
+DELTA_HDR       = struct.Struct('<8sQIIQ')
+PAGE_IDX        = struct.Struct('<Q')
+
+def is_delta(img):
+    """ @brief Checks if a file is a delta image
+    @return Bool """
+
+    try:
+        with open(img, 'rb') as obj:
+            return obj.read(len(DELTA_MAGIC)) == DELTA_MAGIC
+    except OSError:
+        return False
+
+def read_hdr(obj):
+    """ @brief Reads the header and the parent path of a delta image
+    @return Tuple of (img_size, page_size, page_cnt, parent) """
+
+    raw = obj.read(DELTA_HDR.size)
+    if len(raw) != DELTA_HDR.size:
+        raise ValueError('Truncated delta header in ' + obj.name)
+
+    magic, img_size, page_size, parent_len, page_cnt = DELTA_HDR.unpack(raw)
+    if magic != DELTA_MAGIC:
+        raise ValueError('Not a delta image: ' + obj.name)
+
+    return img_size, page_size, page_cnt, obj.read(parent_len).decode()
+
+def apply_delta(delta, base, out):
+    """ @brief Writes the full image of a delta to out, using base as the
+    materialized parent image
+
+    **Example**
+    @code{.py}
+
+    >>> import tempfile
+    >>> d = tempfile.mkdtemp()
+    >>> base, delta, out = [os.path.join(d, f) for f in ['b', 'd', 'o']]
+    >>> with open(base, 'wb') as obj:
+    ...     _ = obj.write(b'a'*10)
+    >>> with open(delta, 'wb') as obj:
+    ...     _ = obj.write(DELTA_HDR.pack(DELTA_MAGIC, 10, 4, 1, 2) + b'b')
+    ...     _ = obj.write(PAGE_IDX.pack(0) + b'XXXX')
+    ...     _ = obj.write(PAGE_IDX.pack(2) + b'YY')
+    >>> apply_delta(delta, base, out)
+    >>> open(out, 'rb').read()
+    b'XXXXaaaaYY'
+
+    @endcode """
+
+    with open(delta, 'rb') as obj:
+        img_size, page_size, page_cnt, _ = read_hdr(obj)
+
+        copyfile(base, out)
+        with open(out, 'r+b') as out_obj:
+            out_obj.truncate(img_size)
+            for _ in range(page_cnt):
+                idx, = PAGE_IDX.unpack(obj.read(PAGE_IDX.size))
+                off = idx*page_size
+
+                # The last page is clamped to the end of the image
+                length = min(page_size, img_size - off)
+                page = obj.read(length)
+                if off >= img_size or len(page) != length:
+                    raise ValueError('Corrupt delta image: ' + delta)
+
+                out_obj.seek(off)
+                out_obj.write(page)
+
+def materialize(deltas):
+    """ @brief Replaces delta images with the full images they describe
+
+    The full image of `<name>.delta` is written to `<name>`. A delta chain is
+    materialized in a single pass, every image starting from its already
+    materialized parent, and the deltas are only removed at the end since
+    they are each other's parents.
+
+    **Example**
+    @code{.py}
+
+    >>> import tempfile
+    >>> d = tempfile.mkdtemp()
+    >>> full = os.path.join(d, 'img.id=000001.crash_site')
+    >>> d2 = os.path.join(d, 'img.id=000002.crash_site.delta')
+    >>> d3 = os.path.join(d, 'img.id=000003.crash_site.delta')
+    >>> with open(full, 'wb') as obj:
+    ...     _ = obj.write(b'aaaa')
+    >>> def write(path, parent, page):
+    ...     with open(path, 'wb') as obj:
+    ...         _ = obj.write(DELTA_HDR.pack(DELTA_MAGIC, 4, 2, len(parent), 1))
+    ...         _ = obj.write(parent.encode() + PAGE_IDX.pack(page) + b'zz')
+    >>> write(d2, full, 0)
+    >>> write(d3, d2, 1)
+    >>> materialize([d3, d2])
+    >>> open(d3[:-len(DELTA_SUFFIX)], 'rb').read()
+    b'zzzz'
+    >>> open(d2[:-len(DELTA_SUFFIX)], 'rb').read()
+    b'zzaa'
+    >>> sorted(os.listdir(d))
+    ['img.id=000001.crash_site', 'img.id=000002.crash_site', 'img.id=000003.crash_site']
+
+    @endcode """
+
+    done = {}
+
+    for delta in deltas:
+        # Walk up the chain (which can be long) to a materialized image
+        chain = []
+        base = delta
+        while base not in done and is_delta(base):
+            chain.append(base)
+            with open(base, 'rb') as obj:
+                base = read_hdr(obj)[3]
+        base = done.get(base, base)
+
+        for link in reversed(chain):
+            out = link[:-len(DELTA_SUFFIX)]
+            apply_delta(link, base, out)
+            done[link] = base = out
+
+    for delta in done:
+        os.remove(delta)
+
+def materialize_run(imgpath, suffix):
+    """ @brief Materializes the delta images written by a failure injection
+    run on imgpath, named as in libpmfuzz's pmfuzz_inject_failure() """
+
+    prefix = imgpath
+    for ext in ['.pm_pool', '.crash_site']:
+        if ext in prefix:
+            prefix = prefix[:prefix.index(ext)]
+
+    materialize(glob('%s.%s.id=*%s' % (prefix, suffix, DELTA_SUFFIX)))
@@ -0,0 +1,184 @@
+"""
+@file       imgstore.py
+@details    Interfaces with pmfuzz-imgstore, the content-addressed PM image
+            store (see src/imgstore)
+@auhor      author
+@copyright  LICENSE
+
+License Text
+
+When the store is enabled, helper.common.compress() adds images to the store
+and writes a small reference file in place of the .tar.gz archive, so the
+naming and lineage of the compressed files is unchanged.
+helper.common.decompress() recognizes reference files and materializes the
+image from the store instead of extracting an archive.
+Reference files are copied and deleted like the archives they replace, so
+gc() treats the reference files left in the output directory as the live
+images, and has the store delete every other image and unused object.
+
+Reference file format (single line):
+    PMFUZZ-IMGSTORE-REF <store dir> <image name> <file name>
+"""
+
+import os
+import subprocess
+import tempfile
+import time
+
+from os import path
+
+from helper.prettyprint import printv
+
+REF_MAGIC   = 'PMFUZZ-IMGSTORE-REF'
+BIN_NAME    = 'pmfuzz-imgstore'
+
+# Store used by compress(), set by configure()
+_store = None
+
+class ImgStore:
+    """ @class Wraps the pmfuzz-imgstore command line tool """
+
+    def __init__(self, root, binary, verbose):
+        self.root       = root
+        self.binary     = binary
+        self.verbose    = verbose
+
+    def cmd(self, *args):
+        return [self.binary, self.root] + list(args)
+
+    def _run(self, cmd):
+        if self.verbose:
+            printv('Cmd: ' + ' '.join(cmd))
+
+        subprocess.run(
+            cmd,
+            check   = True,
+            stdout  = subprocess.PIPE,
+            stderr  = subprocess.PIPE,
+        )
+
+    def put(self, name, img, parent=None):
+        """ @brief Adds an image to the store
+        @param name Name to store the image with
+        @param img Path to the image
+        @param parent Name of the image in the store this one derives from
+        @return None """
+
+        cmd = self.cmd('put', name, img)
+        if parent is not None:
+            cmd.append(parent)
+        self._run(cmd)
+
+    def get(self, name, dest):
+        """ @brief Materializes an image from the store to dest """
+
+        self._run(self.cmd('get', name, dest))
+
+    def gc(self, live_names, since):
+        """ @brief Removes the images not in live_names and the objects no
+        remaining image uses
+        @param live_names Names of the images to keep
+        @param since Epoch time live_names was collected at, images stored
+               after it are kept too
+        @return None """
+
+        fd, live_f = tempfile.mkstemp(prefix='pmfuzz-imgstore-live-')
+        with os.fdopen(fd, 'w') as obj:
+            obj.write(''.join(name + '\n' for name in live_names))
+        os.utime(live_f, (since, since))
+
+        try:
+            self._run(self.cmd('gc', live_f))
+        finally:
+            os.remove(live_f)
+
+def configure(cfg, verbose):
+    """ @brief Enables the store for compress() if the config asks for it
+    @param cfg Config object
+    @return None """
+
+    global _store
+
+    if cfg('pmfuzz.img_store.enable'):
+        binary = path.join(cfg('pmfuzz.bin_dir'), BIN_NAME)
+        _store = ImgStore(cfg('pmfuzz.img_store.path'), binary, verbose)
+    else:
+        _store = None
+
+def get_store():
+    """ @brief Returns the configured store, None if the store is disabled """
+
+    return _store
+
+def get_live_names(root, outdir):
+    """ @brief Names of the images in the store at root that the reference
+    files under outdir refer to
+
+    >>> tmp = tempfile.mkdtemp()
+    >>> os.makedirs(path.join(tmp, 'a'))
+    >>> store = ImgStore('/st', BIN_NAME, False)
+    >>> write_ref(path.join(tmp, 'a', 'x.tar.gz'), store, '/o/x', 'x')
+    >>> write_ref(path.join(tmp, 'y.tar.gz'), store, '/o/y', 'y')
+    >>> write_ref(path.join(tmp, 'z.tar.gz'), ImgStore('/st2', BIN_NAME,
+    ...     False), '/o/z', 'z')
+    >>> with open(path.join(tmp, 'w.tar.gz'), 'w') as obj:
+    ...     _ = obj.write('archive')
+    >>> sorted(get_live_names('/st', tmp))
+    ['/o/x', '/o/y']
+    """
+
+    live = set()
+    for dirpath, _, fnames in os.walk(outdir):
+        for fname in fnames:
+            fpath = path.join(dirpath, fname)
+            if fname.endswith('.tar.gz') and is_ref(fpath):
+                store, name, _ = read_ref(fpath)
+                if path.abspath(store.root) == path.abspath(root):
+                    live.add(name)
+
+    return live
+
+def gc(outdir, verbose):
+    """ @brief Drops the images of the configured store that no reference
+    file under outdir refers to anymore, e.g., after deduplication. The
+    store must not be shared with another output directory.
+    @return None """
+
+    if _store is None:
+        return
+
+    # Whole seconds, the store compares it to file modification times
+    since = int(time.time()) - 1
+    live = get_live_names(_store.root, outdir)
+    if verbose:
+        printv('Collecting image store %s, %d live images' \
+            % (_store.root, len(live)))
+
+    _store.gc(live, since)
+
+def is_ref(fpath):
+    """ @brief Checks if a file is a reference to the image store """
+
+    try:
+        with open(fpath, 'rb') as obj:
+            return obj.read(len(REF_MAGIC)) == REF_MAGIC.encode()
+    except OSError:
+        return False
+
+def read_ref(fpath):
+    """ @brief Reads a reference file
+    @return Tuple of (ImgStore, image name, file name) """
+
+    with open(fpath, 'r') as obj:
+        _, root, name, fname = obj.readline().split()
+
+    binary = _store.binary if _store is not None else BIN_NAME
+    verbose = _store.verbose if _store is not None else False
+
+    return ImgStore(root, binary, verbose), name, fname
+
+def write_ref(fpath, store, name, fname):
+    """ @brief Writes a reference file to an image in the store """
+
+    with open(fpath, 'w') as obj:
+        obj.write('%s %s %s %s\n' % (REF_MAGIC, store.root, name, fname))
@@ -68,6 +68,8 @@
 from helper import common
 from helper.config import Config
 from helper.prettyprint import *
+from interfaces import imgreplay
+from interfaces import imgstore
 
 from core import whatsup as wu
 
@@ -388,6 +390,12 @@ def main():
     cfg.parse()
     cfg.check()
 
+    # Store images in the image store instead of archives, if enabled
+    imgstore.configure(cfg, verbose)
+
+    # Regenerate crash sites on demand instead of storing them, if enabled
+    imgreplay.configure(cfg, verbose)
+
     # Update arguments from config
     update_args_with_cfg(args, cfg)
 
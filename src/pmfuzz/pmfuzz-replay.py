@@ -0,0 +1,69 @@
+#! /usr/bin/env python3
+"""
+@file       pmfuzz-replay.py
+@brief      Regenerates the crash site of a replay reference
+@details    Used by the scripts that get_decompress_cmd() generates, so the
+            target only runs when the script does (see interfaces.imgreplay)
+@auhor      author
+@copyright  LICENSE
+
+License Text
+"""
+
+import argparse
+import os
+import sys
+
+from helper import common
+from helper.config import Config
+from interfaces import imgreplay
+from interfaces import imgstore
+
+PROG_NAME   = common.get_version()['name']
+VERSION_STR = common.get_version()['version']
+AUTHORS_STR = common.get_version()['authors']
+DESC_STR    = PROG_NAME + ': A Persistent Memory Fuzzer, version ' \
+            + VERSION_STR + ' by ' + AUTHORS_STR
+
+def get_options():
+    """ Returns parsed arguments """
+    parser = argparse.ArgumentParser(prog=PROG_NAME, description=DESC_STR,
+                formatter_class=argparse.RawDescriptionHelpFormatter,
+                add_help=False)
+
+    # Required positional arguments
+    reqPos = parser.add_argument_group('Required positional arguments')
+
+    reqPos.add_argument('config', type=str,
+                        help='Points to the config file to use, should' \
+                                + ' conform to: configs/base.yml')
+    reqPos.add_argument('ref', type=str,
+                        help='path to the replay reference')
+    reqPos.add_argument('destdir', type=str,
+                        help='directory to regenerate the crash site in')
+
+    optNam = parser.add_argument_group('Optional named arguments')
+
+    optNam.add_argument('-h', '--help', action='help',
+                        default=argparse.SUPPRESS,
+                        help='show this help message and exit')
+    optNam.add_argument('--verbose', '-v', action='store_true',
+                        help='Enables verbose logging to stdout')
+
+    return parser.parse_args()
+
+def main():
+    args = get_options()
+
+    cfg = Config(args.config, args.verbose)
+    cfg.parse()
+    cfg.check()
+
+    # The parent of the crash site might be in the image store
+    imgstore.configure(cfg, args.verbose)
+    imgreplay.configure(cfg, args.verbose)
+
+    imgreplay.materialize(args.ref, args.destdir, args.verbose)
+
+if __name__  == '__main__':
+    main()
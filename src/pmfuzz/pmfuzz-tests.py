@@ -2,6 +2,10 @@
 import sys
 
 import handlers.name_handler as nh
+import interfaces.afl as afl
+import interfaces.imgreplay as imgreplay
+import interfaces.imgstore as imgstore
+import interfaces.imgsnap as imgsnap
 
 from helper.parallel import Parallel
 
@@ -23,8 +27,16 @@ def main():
 
     f2, t2 = test_parallel()
 
-    failure_count = f1 + f2
-    test_count = t1 + t2
+    f3, t3 = doctest.testmod(imgreplay, verbose=False)
+
+    f4, t4 = doctest.testmod(afl, verbose=False)
+
+    f5, t5 = doctest.testmod(imgsnap, verbose=False)
+
+    f6, t6 = doctest.testmod(imgstore, verbose=False)
+
+    failure_count = f1 + f2 + f3 + f4 + f5 + f6
+    test_count = t1 + t2 + t3 + t4 + t5 + t6
 
     print('%d of %d tests failed.' % (failure_count, test_count))
 
@@ -27,6 +27,7 @@
 from interfaces.afl import gen_tgt_img
 from interfaces.afl import run_afl_tmin
 from interfaces.afl import run_afl_cmin
+from interfaces import imgstore
 from helper.ptimer import PTimer
 from helper.prettyprint import *
 from stages.stage import Stage
@@ -690,6 +691,9 @@ def run(self, fdedup=True, min_tc=True, min_corpus=True, gbl=True):
         else:
             self._deduplicate_lcl(fdedup, min_tc, min_corpus)
 
+        # Drop the stored images of everything deduplication removed
+        imgstore.gc(self.outdir, self.verbose)
+
     @property
     def local_dedup_list(self):
         """ @brief Get all the testcase and corresponding images in the local
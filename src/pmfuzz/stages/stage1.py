@@ -17,6 +17,7 @@
 
 import handlers.name_handler as nh
 import interfaces.failureinjection as finj
+import interfaces.imgreplay as imgreplay
 
 from .dedup import Dedup
 from .stage import Stage
@@ -207,8 +208,13 @@ def add_cs_hash_lcl(self):
 
                 os.remove(hash_f)
 
-    def compress_new_crash_site(self, img):
-        """ Compresses a specific crash site """
+    def compress_new_crash_site(self, img, testcase_f, clean_name, ids):
+        """ Compresses a specific crash site, or writes a replay reference to
+        it if replay is enabled (see interfaces.imgreplay) 
+
+        @param testcase_f Path to the testcase that generated the crash site
+        @param clean_name Clean name of the testcase
+        @param ids Failure ids of all the crash sites of the testcase """
 
         clean_img = re.sub(r"<pid=\d+>", "", img)
         crash_img_name = path.basename(clean_img)
@@ -221,10 +227,24 @@ def compress_new_crash_site(self, img):
         # Check if this crash site works before compressing it
         self.check_crash_site(img)
 
+        replay = imgreplay.get_cache()
+        if replay is not None:
+            # Written by compress_new_crash_sites() before compressing
+            hash_f = path.join(self.img_dir, crash_img_name + '.hash')
+            with open(hash_f, 'r') as hash_obj:
+                img_hash = hash_obj.read().strip()
+
+            # Crash sites of stage 1 are generated on an empty image
+            ref = imgreplay.write_ref(clean_img+'.tar.gz', None, 
+                clean_name.replace('.'+nh.TC_EXT, ''), 
+                imgreplay.get_failure_id(img), ids, img_hash, testcase_f)
+            replay.add(ref, img)
+            return
+
         compress(img, clean_img+'.tar.gz', self.verbose, level=3, 
             extra_params=['--transform', 's/pmfuzz-tmp-img-.........//'])
 
-    def compress_new_crash_sites(self, parent_img, clean_name):
+    def compress_new_crash_sites(self, parent_img, clean_name, testcase_f):
         """ Compresses the crash sites generated for the parent img """
 
         crash_imgs_pattern = parent_img.replace('.'+nh.PM_IMG_EXT, '') \
@@ -276,8 +296,9 @@ def get_hash(img):
             transparent_io=True,
             failure_mode=parallel.Parallel.FAILURE_EXIT
         )
+        ids = [imgreplay.get_failure_id(img) for img in new_crash_imgs]
         for img in new_crash_imgs:
-            prl.run([img])
+            prl.run([img, testcase_f, clean_name, ids])
 
         if self.verbose:
             printv('Waiting for compression to complete')
@@ -285,7 +306,9 @@ def get_hash(img):
         prl.wait()
 
         for img in new_crash_imgs:
-            os.remove(img)
+            # Replayed crash sites were moved to the replay cache
+            if path.isfile(img):
+                os.remove(img)
 
     def tc_gen_crash_sites(self, raw_tcname):
         """ Generates crash sites for a testcase
@@ -322,7 +345,8 @@ def tc_gen_crash_sites(self, raw_tcname):
             printi('Total %d crash images generated.' % len(crash_imgs))
             printv('Compressing all the crash sites')
 
-        self.compress_new_crash_sites(crash_img_prefix, clean_name)
+        self.compress_new_crash_sites(crash_img_prefix, clean_name, 
+            raw_tcname)
         self.add_cs_hash_lcl()
 
         if self.verbose:
@@ -22,6 +22,7 @@
 
 import handlers.name_handler as nh
 import interfaces.failureinjection as finj
+import interfaces.imgreplay as imgreplay
 
 from core.dedupengine import DedupEngine
 from helper import config
@@ -79,11 +80,42 @@ def __init__(self, stage, iter_id, srcdir, outdir, cfg, cores,
 
         self.tc_timeout = cfg['pmfuzz']['stage']['2']['tc_timeout']
 
+        # Images fuzzed together by a single AFL instance, see _resume_multi()
+        self.multi_img = None
+        if cfg('pmfuzz.stage.2.multi_img.enable'):
+            self.multi_img = pickledb.load(
+                path.join(stageoutdir, '@multiimg.db'), True)
+
+    def get_batch(self, name):
+        """ Returns the name of the multi image run fuzzing on the image of 
+        a testcase or crash site, None if it has a run of its own """
+
+        if self.multi_img is None:
+            return None
+
+        batch = self.multi_img.get(name)
+        return batch if batch else None
+
+    def get_batch_members(self, batch):
+        """ Returns the names of the testcases and crash sites of a multi 
+        image run, in the order of its image list, None if batch is not a 
+        multi image run """
+
+        if self.multi_img is None or not batch.startswith('batch='):
+            return None
+
+        info = self.multi_img.get(batch)
+        return info['members'] if info else None
+
     def get_result_dir(self, name):
         """ Returns the path to the queue directory for a run
         @param name str representing the name of the run 
         @return str representing complete path to the queue dir"""
         
+        batch = self.get_batch(name)
+        if batch is not None:
+            name = batch
+
         stage_dir = nh.get_outdir_name(self.stage, self.iter_id)
         tc_dir    = path.join(self.outdir, stage_dir, nh.AFL_DIR_NM, \
                         name)
@@ -112,6 +144,12 @@ def kill_all(self):
                     # Stop this testcase
                     self._terminate_testcase(testcasename, ptimer)
 
+        if self.multi_img is not None:
+            for batch in self.multi_img.get('batches') or []:
+                ptimer = PTimer(self.dedup.dedup_dir_loc, batch, self.verbose)
+                if ptimer.expired():
+                    self._terminate_batch(batch, ptimer)
+
     def terminate(self):
         """ @brief Terminates the current instance of the stage, by organizing 
         all the generated stuff into local directories. 
@@ -186,6 +224,11 @@ def _terminate_testcase(self, testcasename:str, timer):
         """ @brief Terminates a testcase 
         @return None """
 
+        batch = self.get_batch(testcasename)
+        if batch is not None:
+            self._terminate_batch(batch, timer)
+            return
+
         if self.verbose and timer != None:
             time_delta_str = timer.elapsed_hr()
             printv("Time elapsed: {:0>8}".format(time_delta_str))
@@ -316,6 +359,11 @@ def _terminate_cs(self, csname:str, timer):
         
         @return None """
 
+        batch = self.get_batch(csname)
+        if batch is not None:
+            self._terminate_batch(batch, timer)
+            return
+
         if self.verbose and timer != None:
             time_delta_str = timer.elapsed_hr()
             printv("Time elapsed: {:0>8}".format(time_delta_str))
@@ -448,6 +496,217 @@ def _terminate_cs(self, csname:str, timer):
 
             printi('Killed testcase %s (pid %d).' % (csname, pid))
 
+    def _terminate_batch(self, batch:str, timer):
+        """ @brief Terminates a multi image run, every queue entry is 
+        collected as a child of the testcase or crash site whose image it ran
+        on 
+        
+        @return None """
+
+        if self.verbose and timer != None:
+            time_delta_str = timer.elapsed_hr()
+            printv("Time elapsed: {:0>8}".format(time_delta_str))
+
+        q_dir   = path.join(self.get_result_dir(batch), 'queue')
+        pid_f   = path.join(self.get_result_dir(batch), 'pid')
+        members = self.get_batch_members(batch)
+
+        # Kill only if the pid file exists (indicating a running AFL process)
+        if not path.isfile(pid_f):
+            self.printv('Did not kill %s.' % batch)
+            return
+
+        write_state(self.outdir, 'Collecting ' + batch)
+
+        printi('Killing ' + pid_f) 
+
+        with open(pid_f, 'r') as fobj:
+            pid = int(fobj.read().strip())
+
+        os.kill(pid, signal.SIGTERM)
+        remove(pid_f)
+
+        self.printv('Removing directory %s' % self.get_img_dir(batch))
+        rmtree(self.get_img_dir(batch))
+
+        printi('Collecting testcases for %s (%d images)' \
+            % (batch, len(members)))
+
+        core_count = self.cores//2 if self.cores//2 != 0 else 1
+
+        prl_ct = Parallel(
+            self.collect_tc, 
+            core_count, 
+            transparent_io=True, 
+            failure_mode=Parallel.FAILURE_EXIT,
+            name='Collect TC',
+            verbose=self.verbose,
+        )
+        
+        prl_gen_cs = Parallel(
+            self.tc_gen_crash_sites,
+            core_count, 
+            transparent_io=True,
+            failure_mode=Parallel.FAILURE_EXIT,
+            name='Gen Crash Site',
+            verbose=self.verbose,
+        )
+
+        q_dir_contents = [f for f in os.listdir(q_dir) if f.startswith('id')]
+
+        for childtc in q_dir_contents:
+            parent = members[get_img_id(childtc)]
+
+            if self.verbose:
+                printv('Collecting %s (image of %s) from the queue directory' \
+                    % (childtc, parent))
+
+            clean_name = parent + ',' + nh.clean_tc_name(childtc)
+            prl_ct.run([q_dir, childtc, clean_name])
+
+            if self.cfg['pmfuzz']['failure_injection']['enable']:
+                randval = randrange(100)
+                if randval < self.CS_GEN_THRESH:
+                    prl_gen_cs.run([path.join(q_dir, childtc), parent])
+                else:
+                    self.printv('Skipping cs generation'\
+                        +f' ({randval} < {self.CS_GEN_THRESH})')
+
+        prl_ct.wait()
+        prl_gen_cs.wait()
+
+        printi('Cleaning up local uncompressed images')
+        self.clean_up_uncmpr_lcl()
+        self.add_cs_hash_lcl()
+
+        lcl_cfg = self.cfg['pmfuzz']['stage']['dedup']['local']
+        write_state(self.outdir, 'Minimizing local')
+        self.dedup.run(
+            fdedup      = True,
+            min_tc      = False, # TODO
+            min_corpus  = lcl_cfg['minimize_corpus'], 
+            gbl         = False
+        )
+
+        printi('Killed %s (pid %d).' % (batch, pid))
+
+    def _run_batch(self, batch:str, members:list):
+        """ @brief Fuzzes the images of testcases and crash sites with a 
+        single AFL instance 
+
+        @param batch Name of the run
+        @param members List of (name, compressed image, image file name) of 
+               the testcases and crash sites
+        @return None """
+
+        imgdestdir = self.get_img_dir(batch)
+
+        if path.exists(imgdestdir):
+            rmtree(imgdestdir)
+        os.makedirs(imgdestdir)
+
+        imgs = []
+        for name, cmpr_img, img_name in members:
+            decompress(cmpr_img, imgdestdir, self.verbose)
+
+            img = path.join(imgdestdir, img_name)
+            abort_if(not path.isfile(img), 'Cannot find the image of ' + name)
+            imgs.append(img)
+
+        img_list_f = path.join(imgdestdir, 'img_list')
+        write_img_list(img_list_f, imgs)
+
+        # The target opens its image from the link AFL repoints
+        img_link = path.join(imgdestdir, batch + self.dedup.EXT_PM_POOL)
+        _, tgtcmd_loc = nh.set_img_path(self.cfg.tgtcmd, img_link, self.cfg)
+
+        outdir = path.join(self.outdir, nh.get_outdir_name(
+                    self.stage, self.iter_id), nh.AFL_DIR_NM, batch)
+
+        run_afl(
+            indir       = self.srcdir,
+            outdir      = outdir,
+            tgtcmd      = tgtcmd_loc,
+            cfg         = self.cfg,
+            cores       = 1,
+            verbose     = self.verbose,
+            persist_tgt = False,
+            dry_run     = self.dry_run,
+            gen_img     = False,
+            extra_env   = get_img_env(img_list_f, img_link),
+        )
+
+    def _resume_multi(self, finj_enabled):
+        """ @brief Fuzzes the testcase images and crash sites in batches of 
+        pmfuzz.stage.2.multi_img.imgs_per_instance images, each with a single
+        AFL instance that spends its time on the images yielding new PM 
+        paths. A batch runs for tc_timeout seconds per image.
+
+        @return None """
+
+        db = self.multi_img
+        batches = db.get('batches') or []
+
+        run_count = 0
+        for batch in batches:
+            ptimer = PTimer(self.dedup.dedup_dir_loc, batch, self.verbose)
+            if ptimer.expired():
+                self._terminate_batch(batch, None)
+            else:
+                run_count += 1
+
+        printi('Multi image runs: %d/%d' % (run_count, self.cores))
+
+        pending = []
+        for testcasepath, _ in self.dedup.local_dedup_list_st2:
+            name = path.basename(testcasepath).replace(self.dedup.EXT_TC, '')
+            if not db.get(name):
+                img_name = name + self.dedup.EXT_PM_POOL
+                pending.append((name, path.join(self.dedup.dedup_dir_gbl, 
+                    img_name + '.tar.gz'), img_name))
+
+        if finj_enabled:
+            for cspath in self.dedup.local_dedup_list_cs_st2:
+                name = path.basename(cspath)\
+                        .replace('.' + nh.CMPR_CRASH_SITE_EXT, '')
+                if not db.get(name):
+                    pending.append((name, path.join(self.dedup.dedup_dir_loc,
+                        name + '.' + nh.CMPR_CRASH_SITE_EXT), 
+                        name + '.' + nh.CRASH_SITE_EXT))
+
+        per_instance = self.cfg('pmfuzz.stage.2.multi_img.imgs_per_instance')
+
+        while pending and run_count < self.cores:
+            members = pending[:per_instance]
+            pending = pending[per_instance:]
+
+            batch = 'batch=%06d' % (len(batches) + 1)
+            length = self.tc_timeout * len(members)
+
+            printi('Starting %s with %d images' % (batch, len(members)))
+
+            # Member timers keep completed and kill_all() working
+            for name, _, _ in members:
+                db.set(name, batch)
+                PTimer(self.dedup.dedup_dir_loc, name, self.verbose)\
+                    .start_new(length)
+
+            db.set(batch, {'members': [name for name, _, _ in members]})
+            batches.append(batch)
+            db.set('batches', batches)
+
+            PTimer(self.dedup.dedup_dir_loc, batch, self.verbose)\
+                .start_new(length)
+            self._run_batch(batch, members)
+
+            run_count += 1
+
+        for batch in batches:
+            ptimer = PTimer(self.dedup.dedup_dir_loc, batch, self.verbose)
+            if not ptimer.expired():
+                printi('elapsed (%s): %s %s' % (batch, ptimer.elapsed_hr(),
+                    ptimer.elapsed_pb()))
+
     def _run_testcase(self, testcasename:str):
         """ @brief Runs a testcase 
 
@@ -651,6 +910,10 @@ def resume(self):
         else:
             cores_tc = self.cores
 
+        if self.multi_img is not None:
+            self._resume_multi(finj_enabled)
+            return
+
         printi('Slots TC: ' + str(cores_tc))
         printi('Slots CS: ' + str(cores_cs))
 
@@ -743,7 +1006,12 @@ def get_o_tc_dirs(self):
 
         return [full_path(o_tc_dir) for o_tc_dir in o_tc_dirs]
 
-    def process_new_crash_sites(self, parent_img, clean_name):
+    def process_new_crash_sites(self, parent_img, clean_name, 
+            parent_cmpr_img=None, testcase_f=None):
+        """ Compresses the crash sites generated for the parent img, or writes
+        replay references to them if replay is enabled (see 
+        interfaces.imgreplay) """
+
         crash_imgs_pattern = parent_img.replace('.'+nh.CRASH_SITE_EXT, '') \
                                 + '.' + clean_name.replace('.testcase', '') \
                                 + '.*'
@@ -754,6 +1022,7 @@ def process_new_crash_sites(self, parent_img, clean_name):
             printv('Using pattern %s found %d images' \
                 % (crash_imgs_pattern, len(new_crash_imgs)))
 
+        used_imgs = []
         for img in new_crash_imgs:
             # Check the crash site for segfaults and non-zero exit codes
             self.check_crash_site(img)
@@ -762,33 +1031,53 @@ def process_new_crash_sites(self, parent_img, clean_name):
 
             # Only compress a crash site if it would ever be used
             if self.dedup.should_use_cs(clean_img):
-                self.printv(f'Compressing: {img} -> {clean_img}.tar.gz')
-                compress(img, clean_img+'.tar.gz', self.verbose, level=3,
-                    extra_params=['--transform', r's/<pid=[[:digit:]]\+>//'])
+                used_imgs.append(img)
+            else:
+                os.remove(img)
 
-                src = clean_img+'.tar.gz'
-                dst = path.join(self.img_dir, path.basename(clean_img+'.tar.gz'))
+        # A replay of the testcase regenerates all the used crash sites
+        replay = imgreplay.get_cache()
+        used_ids = [imgreplay.get_failure_id(img) for img in used_imgs]
 
-                self.printv('Copying back: %s -> %s' %\
-                    (src, dst))
-                copypreserve(src, dst)
+        for img in used_imgs:
+            clean_img = re.sub(r"<pid=\d+>", "", img)
+            src = clean_img+'.tar.gz'
+            img_hash = sha256sum(img)
+
+            if replay is not None:
+                self.printv(f'Writing replay reference: {img} -> {src}')
+                ref = imgreplay.write_ref(src, parent_cmpr_img, 
+                    clean_name.replace('.testcase', ''), 
+                    imgreplay.get_failure_id(img), used_ids, img_hash, 
+                    testcase_f)
+            else:
+                self.printv(f'Compressing: {img} -> {src}')
+                compress(img, src, self.verbose, level=3,
+                    extra_params=['--transform', r's/<pid=[[:digit:]]\+>//'],
+                    parent=parent_cmpr_img)
 
-                # Save the hash for deduplication
-                hash_f = path.join(
-                    self.img_dir, 
-                    path.basename(clean_img) + '.hash')
+            dst = path.join(self.img_dir, path.basename(src))
 
-                with open(hash_f, 'w') as hash_obj:
-                    hash_obj.write(sha256sum(img))
+            self.printv('Copying back: %s -> %s' %\
+                (src, dst))
+            copypreserve(src, dst)
 
-                hash_k = path.basename(img)
-                hash_v = sha256sum(img)
+            # Save the hash for deduplication
+            hash_f = path.join(
+                self.img_dir, 
+                path.basename(clean_img) + '.hash')
 
-                os.remove(src)
+            with open(hash_f, 'w') as hash_obj:
+                hash_obj.write(img_hash)
 
-            os.remove(img)
+            os.remove(src)
+
+            if replay is not None:
+                replay.add(ref, img)
+            else:
+                os.remove(img)
 
-    def tc_gen_crash_sites(self, raw_tcname):
+    def tc_gen_crash_sites(self, raw_tcname, parent=None):
         """ Generates crash sites for a testcase
 
         Testcases is read and crash sites are generated for each of the 
@@ -797,12 +1086,16 @@ def tc_gen_crash_sites(self, raw_tcname):
         (e.g., <outdir>/stage=2,iter=1/crashsites/)
 
         @param raw_tcname Path to a testcase to generate crash sites for
+        @param parent Name of the testcase or crash site whose image the 
+               testcase ran on, the name of its AFL run if None
         """
 
         printi('Generating crash images for testcase: ' + raw_tcname)
         clean_name = nh.clean_tc_name(path.basename(raw_tcname))
         tc_components = os.path.normpath(raw_tcname).split(os.sep)
-        parent_name = tc_components[-4] + '.testcase'
+        if parent is None:
+            parent = tc_components[-4]
+        parent_name = parent + '.testcase'
 
         printi('Clean name: ' + clean_name)
         printi('Parent name: ' + parent_name)
@@ -855,7 +1148,8 @@ def tc_gen_crash_sites(self, raw_tcname):
         if self.verbose:
             printv('Compressing all the crash sites')
 
-        self.process_new_crash_sites(parent_img_uniq, clean_name)
+        self.process_new_crash_sites(parent_img_uniq, clean_name, 
+            parent_cmpr_img, raw_tcname)
 
         if self.verbose:
             printv('Crash sites compressed')
@@ -948,12 +1242,16 @@ def collect_results(self) -> None:
         for o_dir in o_dirs:
             gen_cases = [name for name in listdir(o_dir) \
                             if name.startswith('id') == True]
+            members = self.get_batch_members(
+                path.basename(path.dirname(path.dirname(o_dir))))
 
             for gen_case in gen_cases:
                 
                 # Parent name (name of the testcase that generated the image 
                 # for this testcase)
                 parent_name = path.dirname(path.dirname(o_dir)) + ','
+                if members is not None:
+                    parent_name = members[get_img_id(gen_case)] + ','
 
                 # Remove unnecessary information from testcase's name and check
                 # if this testcase is not already copied 